@@ -0,0 +1,139 @@
+// Minimal stand-in for the parts of the VCV Rack SDK that svgtheme.hpp uses,
+// so the theme engine can be built and benchmarked without Rack.
+// Only for bench/svt_bench.cpp: not a general replacement for rack.hpp.
+
+#pragma once
+#include <cstdio>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <nanosvg.h>
+
+#define WARN(format, ...) std::fprintf(stderr, "[warn] " format "\n", ##__VA_ARGS__)
+#define DEBUG(format, ...) std::fprintf(stderr, "[debug] " format "\n", ##__VA_ARGS__)
+#define INFO(format, ...) std::fprintf(stderr, "[info] " format "\n", ##__VA_ARGS__)
+
+// nanovg and blendish, for drawing menu items: nothing is drawn.
+struct NVGcontext;
+struct NVGpaint {};
+inline int nvgCreateImageRGBA(NVGcontext*, int, int, int, const unsigned char*) { return 0; }
+inline void nvgDeleteImage(NVGcontext*, int) {}
+inline NVGpaint nvgImagePattern(NVGcontext*, float, float, float, float, float, int, float) { return NVGpaint(); }
+inline void nvgBeginPath(NVGcontext*) {}
+inline void nvgRect(NVGcontext*, float, float, float, float) {}
+inline void nvgFillPaint(NVGcontext*, NVGpaint) {}
+inline void nvgFill(NVGcontext*) {}
+#define BND_WIDGET_HEIGHT 21
+inline float bndLabelWidth(NVGcontext*, int, const char*) { return 0.f; }
+
+#define CHECKMARK_STRING "\xE2\x9C\x94"
+#define CHECKMARK(_cond) ((_cond) ? CHECKMARK_STRING : "")
+
+namespace rack {
+
+struct Exception : std::runtime_error {
+    explicit Exception(const std::string& message) : std::runtime_error(message) {}
+};
+
+namespace window {
+
+struct Window {
+    NVGcontext* vg = nullptr;
+};
+
+// Rack loads SVGs with a DPI of 75.
+static const float SVG_DPI = 75.f;
+
+struct Svg {
+    NSVGimage* handle = nullptr;
+
+    ~Svg() {
+        if (handle) nsvgDelete(handle);
+    }
+
+    void loadFile(const std::string& filename) {
+        handle = nsvgParseFromFile(filename.c_str(), "px", SVG_DPI);
+        if (!handle) throw Exception("Failed to load SVG " + filename);
+    }
+};
+
+} // namespace window
+
+struct Context {
+    window::Window* window = nullptr;
+};
+inline Context* contextGet() {
+    static window::Window window;
+    static Context context;
+    context.window = &window;
+    return &context;
+}
+#define APP rack::contextGet()
+
+namespace widget {
+
+struct EventContext {};
+
+struct Widget {
+    struct Box {
+        struct { float x = 0.f, y = 0.f; } pos, size;
+    } box;
+    Widget* parent = nullptr;
+    std::list<Widget*> children;
+
+    struct DirtyEvent {
+        EventContext* context = nullptr;
+    };
+    struct ActionEvent {
+        EventContext* context = nullptr;
+    };
+    struct DrawArgs {
+        NVGcontext* vg = nullptr;
+    };
+
+    virtual ~Widget() {
+        for (Widget* child : children) delete child;
+    }
+    void addChild(Widget* child) {
+        child->parent = this;
+        children.push_back(child);
+    }
+    virtual void onDirty(const DirtyEvent& e) {
+        for (Widget* child : children) child->onDirty(e);
+    }
+    virtual void step() {}
+    virtual void draw(const DrawArgs&) {}
+};
+
+} // namespace widget
+
+namespace ui {
+
+struct MenuItem : widget::Widget {
+    std::string text;
+    std::string rightText;
+
+    void step() override {}
+    void draw(const DrawArgs&) override {}
+    virtual void onAction(const ActionEvent&) {}
+};
+
+struct Menu : widget::Widget {};
+
+} // namespace ui
+
+using widget::EventContext;
+using widget::Widget;
+using ui::Menu;
+
+inline ui::MenuItem* createCheckMenuItem(std::string text, std::string, std::function<bool()>, std::function<void()>) {
+    auto item = new ui::MenuItem;
+    item->text = text;
+    return item;
+}
+
+} // namespace rack
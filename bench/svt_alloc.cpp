@@ -0,0 +1,34 @@
+// svt_alloc - the allocation counting for svt_bench.
+//
+// The replacement operator new and delete live in their own translation
+// unit: when GCC can inline them into the code that calls them, it sees
+// operator delete call free() on memory from operator new, and reports
+// -Wmismatched-new-delete at every delete.
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<size_t> allocations(0);
+
+size_t Allocations()
+{
+    return allocations;
+}
+
+void* operator new(size_t size) {
+    ++allocations;
+    void * p = std::malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    ++allocations;
+    return std::malloc(size ? size : 1);
+}
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept { return operator new(size, tag); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
@@ -0,0 +1,688 @@
+// svt_bench - headless benchmarks for svg_theme.
+//
+// Builds svgtheme.hpp and svt_rack.hpp against plain nanosvg and Jansson,
+// with the small Rack stand-in in bench/rack_stub, and measures the load and
+// apply paths.
+//
+// Build with `make svt_bench` from the repository root, then run it there:
+//
+//     ./svt_bench [resource folder, default res]
+//
+// Each benchmark reports ns/op and heap allocations/op (operator new only:
+// nanosvg's own mallocs are not counted). The process peak RSS is reported
+// at the end.
+//
+// Build with -DSVG_THEME_STATS to measure the engine with its stats
+// counting, and to print the stats of the main SvgThemes at the end.
+
+#define IMPLEMENT_SVG_THEME
+#define NANOSVG_IMPLEMENTATION
+#define SVG_THEME_PREVIEWS // the previews are benchmarked too
+#include "../svgtheme.hpp"
+#include "../svt_rack.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+using namespace svg_theme;
+
+// ----------------------------------------------------------------------------
+// allocation counting
+
+// Heap allocations so far, counted by the operator new in svt_alloc.cpp.
+size_t Allocations();
+
+// ----------------------------------------------------------------------------
+// harness
+
+typedef std::chrono::steady_clock Clock;
+
+// Run `op` in doubling batches until a batch takes at least 0.2s,
+// then report the last batch. Returns its ns/op.
+template <typename Op>
+double bench(const char * name, Op op)
+{
+    op(); // warm up
+    size_t iterations = 1;
+    for (;;) {
+        size_t allocs_before = Allocations();
+        auto start = Clock::now();
+        for (size_t n = 0; n < iterations; ++n) {
+            op();
+        }
+        auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        size_t allocs = Allocations() - allocs_before;
+        if (elapsed >= 0.2 || iterations >= (size_t(1) << 30)) {
+            double ns = elapsed * 1e9 / iterations;
+            std::printf("%-44s %10zu %14.1f ns/op %10.2f allocs/op\n", name, iterations,
+                ns, double(allocs) / iterations);
+            return ns;
+        }
+        iterations *= 2;
+    }
+}
+
+static long PeakRssKB()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// generated inputs
+
+static const char * TAGS[] = { "panel", "logo-text", "logo-circle", "screw-slot", "screw-rim" };
+
+// An SVG with `count` shapes, four of every five tagged with a Demo theme tag.
+static std::string GenerateSvg(int count)
+{
+    std::string svg = "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"500\" height=\"500\">\n"
+        "<linearGradient id=\"g\" x1=\"0\" y1=\"0\" x2=\"1\" y2=\"1\">"
+        "<stop offset=\"0\" stop-color=\"#ABA9A9\"/><stop offset=\"1\" stop-color=\"#8F8F8F\"/></linearGradient>\n";
+    char line[200];
+    for (int n = 0; n < count; ++n) {
+        int kind = n % 5;
+        const char * fill = (kind == 4) ? "url(#g)" : "#808080";
+        if (n % 25 == 24) {
+            std::snprintf(line, sizeof(line), "<rect id=\"plain%d\" x=\"%d\" y=\"%d\" width=\"4\" height=\"4\" fill=\"#123456\"/>\n",
+                n, n % 500, (n / 500) % 500);
+        } else {
+            std::snprintf(line, sizeof(line), "<rect id=\"r%d--%s\" x=\"%d\" y=\"%d\" width=\"4\" height=\"4\" fill=\"%s\" stroke=\"#000\"/>\n",
+                n, TAGS[kind], n % 500, (n / 500) % 500, fill);
+        }
+        svg += line;
+    }
+    svg += "</svg>\n";
+    return svg;
+}
+
+// A themes sheet with `theme_count` themes of `style_count` styles each.
+static std::string GenerateThemes(int theme_count, int style_count)
+{
+    std::string json = "[\n";
+    char line[300];
+    for (int t = 0; t < theme_count; ++t) {
+        std::snprintf(line, sizeof(line), "%s{ \"name\": \"Theme %d\", \"theme\": {\n", t ? ",\n" : "", t);
+        json += line;
+        for (int s = 0; s < style_count; ++s) {
+            unsigned color = (t * 7919u + s * 104729u) & 0xFFFFFF;
+            if (s % 3 == 0) {
+                std::snprintf(line, sizeof(line), "%s\"tag-%d\": { \"fill\": \"#%06x\", \"stroke\": { \"color\": \"#%06x80\", \"width\": 1.5 } }",
+                    s ? ",\n" : "", s, color, color ^ 0xFFFFFF);
+            } else if (s % 3 == 1) {
+                std::snprintf(line, sizeof(line), "%s\"tag-%d\": { \"opacity\": 0.75, \"fill\": { \"gradient\": [ "
+                    "{ \"index\": 0, \"color\": \"#%06x\", \"offset\": 0 }, { \"index\": 1, \"color\": \"#%06x\", \"offset\": 1 } ] } }",
+                    s ? ",\n" : "", s, color, color >> 1);
+            } else {
+                std::snprintf(line, sizeof(line), "%s\"tag-%d\": { \"fill\": \"none\", \"stroke\": \"#%03x\" }",
+                    s ? ",\n" : "", s, color & 0xFFF);
+            }
+            json += line;
+        }
+        json += "\n} }";
+    }
+    json += "\n]\n";
+    return json;
+}
+
+// A themes sheet like a family of variants: "Theme 0" has `style_count`
+// styles, and each of the others extends it, changing one style in ten.
+static std::string GenerateDerivedThemes(int theme_count, int style_count)
+{
+    std::string json = "[\n";
+    char line[300];
+    for (int t = 0; t < theme_count; ++t) {
+        if (t) {
+            std::snprintf(line, sizeof(line), ",\n{ \"name\": \"Theme %d\", \"extends\": \"Theme 0\", \"theme\": {\n", t);
+        } else {
+            std::snprintf(line, sizeof(line), "{ \"name\": \"Theme 0\", \"theme\": {\n");
+        }
+        json += line;
+        bool first = true;
+        for (int s = t ? t % 10 : 0; s < style_count; s += t ? 10 : 1) {
+            unsigned color = (t * 7919u + s * 104729u) & 0xFFFFFF;
+            std::snprintf(line, sizeof(line), "%s\"tag-%d\": { \"fill\": \"#%06x\", \"stroke\": { \"color\": \"#%06x80\", \"width\": 1.5 } }",
+                first ? "" : ",\n", s, color, color ^ 0xFFFFFF);
+            json += line;
+            first = false;
+        }
+        json += "\n} }";
+    }
+    json += "\n]\n";
+    return json;
+}
+
+// A themed widget holding an SVG from a file, like ThemeScrew in the Demo.
+struct BenchScrew : rack::Widget, IApplyTheme, IThemeTargets
+{
+    std::string file;
+    std::shared_ptr<rack::window::Svg> svg;
+
+    BenchScrew(const std::string& file) : file(file) {}
+
+    void setSvg(std::shared_ptr<rack::window::Svg> svg) {
+        this->svg = svg;
+    }
+    bool applyTheme(SvgThemes& themes, std::shared_ptr<Theme> theme) override {
+        return ApplyThemeToSvg(themes, theme, file, svg);
+    }
+    void addThemeTargets(ThemeBatch& batch) override {
+        batch.add(file, svg, [this](std::shared_ptr<rack::window::Svg> svg) { setSvg(svg); }, this);
+    }
+};
+
+// A themed widget that only implements IApplyTheme.
+struct BenchPanel : rack::Widget, IApplyTheme
+{
+    std::string file;
+    std::shared_ptr<rack::window::Svg> svg;
+
+    BenchPanel(const std::string& file) : file(file) {}
+
+    bool applyTheme(SvgThemes& themes, std::shared_ptr<Theme> theme) override {
+        return ApplyThemeToSvg(themes, theme, file, svg);
+    }
+};
+
+static bool WriteText(const std::string& filename, const std::string& text)
+{
+    FILE* file = std::fopen(filename.c_str(), "wb");
+    if (!file) return false;
+    bool ok = text.size() == std::fwrite(text.data(), 1, text.size(), file);
+    return (0 == std::fclose(file)) && ok;
+}
+
+static NSVGimage* ParseSvgText(const std::string& text)
+{
+    std::vector<char> buffer(text.begin(), text.end());
+    buffer.push_back(0);
+    return nsvgParse(buffer.data(), "px", 75.f);
+}
+
+// ----------------------------------------------------------------------------
+// checks
+
+// ParseHexColors must agree with ParseHexColor, including on invalid and
+// over-long text, where it sets opaque black.
+static bool CheckHexColors()
+{
+    static const char chars[] = "#0123456789abcdefABCDEFgG /:@`\x80\xff";
+    std::vector<std::string> texts;
+    unsigned int seed = 12345;
+    for (int n = 0; n < 200000; ++n) {
+        std::string text;
+        seed = seed * 1103515245u + 12345u;
+        size_t length = (seed >> 16) % 20;
+        for (size_t i = 0; i < length; ++i) {
+            seed = seed * 1103515245u + 12345u;
+            // Mostly hex digits after a leading '#', so that many are valid
+            size_t pick = (seed >> 16) % 100;
+            text.push_back(i == 0 && pick < 90 ? '#'
+                : pick < 90 ? chars[1 + pick % 22] : chars[(seed >> 8) % (sizeof(chars) - 1)]);
+        }
+        texts.push_back(text);
+    }
+    std::vector<const char *> ptrs;
+    std::vector<size_t> lengths;
+    for (const std::string& text : texts) {
+        ptrs.push_back(text.c_str());
+        lengths.push_back(text.size());
+    }
+    std::vector<PackedColor> colors(texts.size());
+    std::unique_ptr<bool[]> valid(new bool[texts.size()]);
+    size_t valid_count = ParseHexColors(ptrs.data(), lengths.data(), texts.size(), colors.data(), valid.get());
+    size_t expected_count = 0;
+    for (size_t n = 0; n < texts.size(); ++n) {
+        PackedColor expected = OPAQUE_BLACK;
+        bool ok = ParseHexColor(ptrs[n], lengths[n], expected);
+        expected_count += ok;
+        if (ok != valid[n] || expected != colors[n]) {
+            std::fprintf(stderr, "ParseHexColors differs from ParseHexColor on '%s'\n", texts[n].c_str());
+            return false;
+        }
+    }
+    if (valid_count != expected_count || !valid_count || valid_count == texts.size()) {
+        std::fprintf(stderr, "ParseHexColors: %zu valid colors, expected %zu\n", valid_count, expected_count);
+        return false;
+    }
+    return true;
+}
+
+// Each theme in `other` must have the same styles, tag for tag, as in `themes`.
+static bool SameThemes(SvgThemes& themes, SvgThemes& other, const char * loader, const std::string& file)
+{
+    std::vector<std::string> names = themes.getThemeNames();
+    if (names.empty() || names != other.getThemeNames()) {
+        std::fprintf(stderr, "%s %s: the themes differ from load\n", loader, file.c_str());
+        return false;
+    }
+    for (const std::string& name : names) {
+        auto theme = themes.getTheme(name);
+        auto theirs = other.getTheme(name);
+        size_t styled = 0;
+        for (size_t id = 0; id < theme->styles.size(); ++id) {
+            if (!theme->styles[id]) continue;
+            ++styled;
+            const std::string& tag = theme->tags->name(static_cast<int>(id));
+            const Style* style = theirs->getStyle(tag);
+            if (!style || !(*style == *theme->styles[id])) {
+                std::fprintf(stderr, "%s %s: theme '%s' tag '%s' differs from load\n",
+                    loader, file.c_str(), name.c_str(), tag.c_str());
+                return false;
+            }
+        }
+        size_t their_styled = 0;
+        for (const Style* style : theirs->styles) {
+            their_styled += (style != nullptr);
+        }
+        if (styled != their_styled) {
+            std::fprintf(stderr, "%s %s: theme '%s' styles %zu tags, load styles %zu\n",
+                loader, file.c_str(), name.c_str(), their_styled, styled);
+            return false;
+        }
+    }
+    return true;
+}
+
+// loadStreaming, and loadCompiled of what saveCompiled wrote, must give the
+// same themes as load.
+static bool CheckLoaders(const std::string& file, const std::string& compiled_file)
+{
+    SvgThemes themes, streamed, compiled;
+    if (!themes.load(file) || !streamed.loadStreaming(file)
+        || !themes.saveCompiled(compiled_file) || !compiled.loadCompiled(compiled_file)) {
+        std::fprintf(stderr, "cannot load %s\n", file.c_str());
+        return false;
+    }
+    return SameThemes(themes, streamed, "loadStreaming", file)
+        && SameThemes(themes, compiled, "loadCompiled", file);
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    std::string res = argc > 1 ? argv[1] : "res";
+    std::string themes_file = res + "/Demo-themes.json";
+    std::string panel_file = res + "/Demo.svg";
+    std::string screw_file = res + "/Screw.svg";
+
+    std::string big_themes_file = "svt_bench-themes.json";
+    std::string derived_themes_file = "svt_bench-derived.json";
+    std::string compiled_file = "svt_bench-themes.svtc";
+    if (!WriteText(big_themes_file, GenerateThemes(40, 2000))) {
+        std::fprintf(stderr, "cannot write %s\n", big_themes_file.c_str());
+        return 1;
+    }
+    if (!WriteText(derived_themes_file, GenerateDerivedThemes(12, 2000))) {
+        std::fprintf(stderr, "cannot write %s\n", derived_themes_file.c_str());
+        return 1;
+    }
+
+    if (!CheckHexColors()
+        || !CheckLoaders(themes_file, compiled_file)
+        || !CheckLoaders(big_themes_file, compiled_file)
+        || !CheckLoaders(derived_themes_file, compiled_file)) {
+        return 1;
+    }
+
+    std::printf("%-44s %10s\n", "benchmark", "iterations");
+
+    // ---- colors
+
+    std::vector<std::string> color_texts;
+    for (unsigned int n = 0; n < 10000; ++n) {
+        char text[16];
+        unsigned int color = n * 2654435761u;
+        switch (n % 4) {
+            case 0: std::snprintf(text, sizeof(text), "#%03x", color & 0xFFF); break;
+            case 1: std::snprintf(text, sizeof(text), "#%04X", color & 0xFFFF); break;
+            case 2: std::snprintf(text, sizeof(text), "#%06x", color & 0xFFFFFF); break;
+            default: std::snprintf(text, sizeof(text), "#%08X", color); break;
+        }
+        color_texts.push_back(text);
+    }
+    std::vector<const char *> color_ptrs;
+    std::vector<size_t> color_lengths;
+    for (const std::string& text : color_texts) {
+        color_ptrs.push_back(text.c_str());
+        color_lengths.push_back(text.size());
+    }
+    std::vector<PackedColor> colors(color_texts.size());
+    bench("ParseHexColor x 10000", [&]() {
+        for (size_t n = 0; n < color_texts.size(); ++n) {
+            ParseHexColor(color_ptrs[n], color_lengths[n], colors[n]);
+        }
+    });
+    bench("ParseHexColors x 10000", [&]() {
+        ParseHexColors(color_ptrs.data(), color_lengths.data(), color_ptrs.size(), colors.data(), nullptr);
+    });
+
+    // ---- load
+
+    bench("load Demo-themes.json", [&]() {
+        SvgThemes themes;
+        themes.load(themes_file);
+    });
+    bench("load 40 themes x 2000 styles", [&]() {
+        SvgThemes themes;
+        themes.load(big_themes_file);
+    });
+    bench("loadStreaming 40 themes x 2000 styles", [&]() {
+        SvgThemes themes;
+        themes.loadStreaming(big_themes_file);
+    });
+    bench("lazy load 40 x 2000, use 1 theme", [&]() {
+        SvgThemes themes;
+        themes.setLazy(true);
+        themes.load(big_themes_file);
+        themes.getTheme("Theme 0");
+    });
+    bench("load 12 themes x 2000 styles, extending one", [&]() {
+        SvgThemes themes;
+        themes.load(derived_themes_file);
+    });
+    bench("loadStreaming 12 x 2000, extending one", [&]() {
+        SvgThemes themes;
+        themes.loadStreaming(derived_themes_file);
+    });
+    {
+        SvgThemes themes;
+        themes.load(derived_themes_file);
+        auto theme = themes.getTheme("Theme 0");
+        std::printf("%-44s %10zu distinct styles for 12 x 2000 tags\n", "  style pool", theme->pool->size());
+    }
+    {
+        SvgThemes themes;
+        themes.load(big_themes_file);
+        themes.saveCompiled(compiled_file);
+    }
+    bench("loadCompiled 40 themes x 2000 styles", [&]() {
+        SvgThemes themes;
+        themes.loadCompiled(compiled_file);
+    });
+
+    // ---- apply
+
+    SvgThemes themes;
+    if (!themes.load(themes_file)) {
+        std::fprintf(stderr, "cannot load %s\n", themes_file.c_str());
+        return 1;
+    }
+    auto light = themes.getTheme("Light");
+    auto dark = themes.getTheme("Dark");
+
+    struct Target { const char * name; NSVGimage* svg; };
+    NSVGimage* big_svg = ParseSvgText(GenerateSvg(10000));
+    Target targets[] = {
+        { "Demo.svg", nsvgParseFromFile(panel_file.c_str(), "px", 75.f) },
+        { "Screw.svg", nsvgParseFromFile(screw_file.c_str(), "px", 75.f) },
+        { "10k shapes", big_svg },
+    };
+    char name[100];
+    for (const Target& target : targets) {
+        if (!target.svg) {
+            std::fprintf(stderr, "cannot load %s\n", target.name);
+            return 1;
+        }
+        ThemedImage themed(target.svg);
+        std::snprintf(name, sizeof(name), "applyTheme same theme, %s", target.name);
+        bench(name, [&]() {
+            themes.applyTheme(dark, themed);
+        });
+        std::snprintf(name, sizeof(name), "applyTheme switch themes, %s", target.name);
+        bool flip = false;
+        bench(name, [&]() {
+            themes.applyTheme((flip = !flip) ? light : dark, themed);
+        });
+        std::snprintf(name, sizeof(name), "applyThemeDelta switch themes, %s", target.name);
+        flip = false;
+        bench(name, [&]() {
+            flip = !flip;
+            themes.applyThemeDelta(flip ? dark : light, flip ? light : dark, themed);
+        });
+        std::snprintf(name, sizeof(name), "applyTheme / restoreDefault toggle, %s", target.name);
+        flip = false;
+        bench(name, [&]() {
+            if ((flip = !flip)) {
+                themes.applyTheme(dark, themed);
+            } else {
+                themes.restoreDefault(themed);
+            }
+        });
+        std::snprintf(name, sizeof(name), "applyTheme without a ThemedImage, %s", target.name);
+        bench(name, [&]() {
+            themes.applyTheme(dark, target.svg);
+        });
+    }
+
+    // ---- swapping colors and gradients
+
+    {
+        static const StyleEntry solid[] = {
+            { "panel", Style("#202020"_hex) },
+            { "logo-text", Style("#e0e0e0"_hex, Paint::none()) },
+            { "logo-circle", Style("#e0e0e0"_hex) },
+        };
+        static const StyleEntry shaded[] = {
+            { "panel", Style(Gradient(GradientStop(0, 0.f, "#202020"_hex), GradientStop(1, 1.f, "#404040"_hex))) },
+            { "logo-text", Style(Gradient(GradientStop(0, 0.f, "#e0e0e0"_hex), GradientStop(1, .5f, "#c0c0c0"_hex), GradientStop(2, 1.f, "#a0a0a0"_hex)), Paint::none()) },
+            { "logo-circle", Style(Gradient(GradientStop(0, 0.f, "#e0e0e0"_hex), GradientStop(1, 1.f, "#808080"_hex))) },
+        };
+        SvgThemes swaps;
+        swaps.addTheme("Solid", solid);
+        swaps.addTheme("Shaded", shaded);
+        auto solid_theme = swaps.getTheme("Solid");
+        auto shaded_theme = swaps.getTheme("Shaded");
+        ThemedImage themed(big_svg);
+        bool flip = false;
+        bench("applyTheme color <-> gradient, 10k shapes", [&]() {
+            swaps.applyTheme((flip = !flip) ? shaded_theme : solid_theme, themed);
+        });
+        // Put the image back as it was for the benchmarks that follow.
+        swaps.restoreDefault(themed);
+    }
+
+    // ---- reload polling
+
+    themes.setReloadInterval(0);
+    bench("reload() unchanged, checking the file", [&]() {
+        themes.reload();
+    });
+    themes.setReloadInterval(0.25);
+    bench("reload() unchanged, between checks", [&]() {
+        themes.reload();
+    });
+
+    // ---- themed SVG cache
+
+    auto& cache = ThemeCacheManager::of(themes).svgCache();
+    std::shared_ptr<rack::window::Svg> svg;
+    bench("ApplyThemeToSvg cache hit, Demo.svg", [&]() {
+        ApplyThemeToSvg(themes, dark, panel_file, svg);
+    });
+    // A one-entry budget with alternating themes misses every time, but
+    // keeps the master: this is the clone + theme cost.
+    cache.setBudget(1, 0);
+    bool miss_flip = false;
+    bench("ApplyThemeToSvg cache miss, Demo.svg", [&]() {
+        svg = nullptr;
+        ApplyThemeToSvg(themes, (miss_flip = !miss_flip) ? light : dark, panel_file, svg);
+    });
+    cache.setBudget(0, 0);
+    bench("ApplyThemeToSvg cache miss + parse, Demo.svg", [&]() {
+        cache.clear();
+        svg = nullptr;
+        ApplyThemeToSvg(themes, dark, panel_file, svg);
+    });
+    std::vector<std::string> theme_names = themes.getThemeNames();
+    bench("PrewarmThemedSvgs Demo.svg + Screw.svg, all themes", [&]() {
+        cache.clear();
+        PrewarmThemedSvgs(themes, { panel_file, screw_file }, theme_names);
+        themes.waitPrewarm();
+    });
+    // What a menu does when it opens again: everything is cached, so
+    // nothing is queued.
+    bench("PrewarmThemedSvgs Demo.svg + Screw.svg, all cached", [&]() {
+        PrewarmThemedSvgs(themes, { panel_file, screw_file }, theme_names);
+    });
+    themes.waitPrewarm();
+    if (cache.claim(panel_file, *dark) || cache.claim(screw_file, *light)) {
+        std::fprintf(stderr, "PrewarmThemedSvgs left themed SVGs out of the cache\n");
+        return 1;
+    }
+
+    // ---- theme previews
+
+    {
+        auto& previews = *ThemeCacheManager::of(themes).previewCache();
+        std::shared_ptr<rack::window::Svg> themed;
+        ApplyThemeToSvg(themes, dark, panel_file, themed);
+        ThemePreview preview;
+        bench("RenderThemePreview 120x40, Demo.svg", [&]() {
+            RenderThemePreview(themed->handle, 120, 40, preview);
+        });
+        bench("RequestThemePreviews 120x40, Demo.svg, all themes", [&]() {
+            previews.clear();
+            RequestThemePreviews(themes, panel_file, theme_names, 120, 40);
+            themes.waitPrewarm();
+        });
+        // What a menu item does each frame until its preview is ready
+        bench("ThemePreviewCache find, hit", [&]() {
+            previews.find(panel_file, *dark, 120, 40);
+        });
+        previews.clear();
+    }
+
+    cache.clear();
+    std::shared_ptr<rack::window::Svg> panel, screw;
+    bool flip = false;
+    bench("switch themes, panel + 4 screws", [&]() {
+        auto theme = (flip = !flip) ? light : dark;
+        ApplyThemeToSvg(themes, theme, panel_file, panel);
+        for (int n = 0; n < 4; ++n) {
+            ApplyThemeToSvg(themes, theme, screw_file, screw);
+        }
+    });
+
+    // Cached variants share the master's paths, so each theme adds only
+    // its shapes and gradients.
+    std::string big_svg_file = "svt_bench-10k.svg";
+    if (WriteText(big_svg_file, GenerateSvg(10000))) {
+        cache.clear();
+        cache.resetStats();
+        std::vector<std::shared_ptr<rack::window::Svg>> variants(theme_names.size());
+        for (size_t n = 0; n < theme_names.size(); ++n) {
+            ApplyThemeToSvg(themes, themes.getTheme(theme_names[n]), big_svg_file, variants[n]);
+        }
+        auto master = cache.getMaster(big_svg_file);
+        std::printf("  themed cache, 10k shapes x %zu themes %9zu KB (master %zu KB)\n",
+            theme_names.size(), cache.getStats().bytes / 1024, ImageBytes(master ? master->handle : nullptr) / 1024);
+        cache.clear();
+        std::remove(big_svg_file.c_str());
+    }
+
+    // ---- widget trees
+
+    // 100 modules, each with a panel, 4 screws, and 40 unthemed widgets
+    // (like ports and lights) two levels deep: about 12,500 widgets.
+    rack::Widget rack_widget;
+    std::vector<ThemeDispatcher> dispatchers(100);
+    for (ThemeDispatcher& dispatcher : dispatchers) {
+        auto module = new rack::Widget;
+        for (int n = 0; n < 40; ++n) {
+            auto port = new rack::Widget;
+            port->addChild(new rack::Widget);
+            port->addChild(new rack::Widget);
+            module->addChild(port);
+        }
+        for (int n = 0; n < 4; ++n) {
+            module->addChild(dispatcher.adopt(new BenchScrew(screw_file)));
+        }
+        module->addChild(dispatcher.adopt(new BenchPanel(panel_file)));
+        rack_widget.addChild(module);
+    }
+    double walk_ns = bench("ApplyChildrenTheme, 100 modules", [&]() {
+        ApplyChildrenTheme(&rack_widget, themes, (flip = !flip) ? light : dark);
+    });
+    bench("ApplyChildrenThemeBatch, 100 modules", [&]() {
+        ApplyChildrenThemeBatch(&rack_widget, themes, (flip = !flip) ? light : dark);
+    });
+    double dispatch_ns = bench("ThemeDispatcher, 100 modules", [&]() {
+        auto theme = (flip = !flip) ? light : dark;
+        for (ThemeDispatcher& dispatcher : dispatchers) {
+            dispatcher.applyTheme(themes, theme);
+        }
+    });
+    std::printf("%-44s %10.1f x faster than ApplyChildrenTheme\n", "  ThemeDispatcher, 100 modules", walk_ns / dispatch_ns);
+
+    // 100 modules nested the way real module widgets are: module > panel >
+    // 4 containers > 10 widgets > 2 parts > 2 children, with a screw in each
+    // container and the panel art in the first, 4 levels below the rack:
+    // about 29,000 widgets, 6 levels deep.
+    rack::Widget nested_rack;
+    std::vector<ThemeDispatcher> nested_dispatchers(100);
+    for (ThemeDispatcher& dispatcher : nested_dispatchers) {
+        auto module = new rack::Widget;
+        auto panel = new rack::Widget;
+        for (int c = 0; c < 4; ++c) {
+            auto container = new rack::Widget;
+            for (int n = 0; n < 10; ++n) {
+                auto widget = new rack::Widget;
+                for (int p = 0; p < 2; ++p) {
+                    auto part = new rack::Widget;
+                    part->addChild(new rack::Widget);
+                    part->addChild(new rack::Widget);
+                    widget->addChild(part);
+                }
+                container->addChild(widget);
+            }
+            container->addChild(dispatcher.adopt(new BenchScrew(screw_file)));
+            panel->addChild(container);
+        }
+        panel->children.front()->addChild(dispatcher.adopt(new BenchPanel(panel_file)));
+        module->addChild(panel);
+        nested_rack.addChild(module);
+    }
+    double nested_walk_ns = bench("ApplyChildrenTheme, nested 6 deep", [&]() {
+        ApplyChildrenTheme(&nested_rack, themes, (flip = !flip) ? light : dark);
+    });
+    bench("ApplyChildrenThemeBatch, nested 6 deep", [&]() {
+        ApplyChildrenThemeBatch(&nested_rack, themes, (flip = !flip) ? light : dark);
+    });
+    double nested_dispatch_ns = bench("ThemeDispatcher, nested 6 deep", [&]() {
+        auto theme = (flip = !flip) ? light : dark;
+        for (ThemeDispatcher& dispatcher : nested_dispatchers) {
+            dispatcher.applyTheme(themes, theme);
+        }
+    });
+    std::printf("%-44s %10.1f x faster than ApplyChildrenTheme\n", "  ThemeDispatcher, nested 6 deep", nested_walk_ns / nested_dispatch_ns);
+
+#ifdef SVG_THEME_STATS
+    // ---- engine stats
+
+    bench("getStats", [&]() {
+        themes.getStats();
+    });
+    std::printf("stats %s\n", themes.getStats().toJson().c_str());
+#endif
+
+    for (const Target& target : targets) {
+        nsvgDelete(target.svg);
+    }
+    std::remove(big_themes_file.c_str());
+    std::remove(derived_themes_file.c_str());
+    std::remove(compiled_file.c_str());
+
+    std::printf("peak RSS %ld KB\n", PeakRssKB());
+    return 0;
+}
@@ -11,37 +11,39 @@ struct DemoModule : Module
 {
     // This is the name of the selected theme, to save in json
     std::string theme;
-    // The svg_theme engine
-    svg_theme::SvgThemes themes;
-
-    DemoModule() {
-        // For demo and authoring purposes, we log to the Rack log.
-        //
-        // In a production VCV Rack module in the library, logging to Rack's log is disallowed.
-        // The logging is necessary only when authoring your theme and SVG.
-        // Once your theme is correctly applying to the SVG, you do not need this logging
-        // because it's useless to anyone other than someone modifying the SVG or theme.
-        //
-        themes.setLog([](svg_theme::Severity severity, svg_theme::ErrorCode code, std::string info)->void {
-            DEBUG("Theme %s (%d): %s", SeverityName(severity), code, info.c_str());
-        });
-    }
+    // The svg_theme engine, shared by all Demo modules
+    std::shared_ptr<svg_theme::SvgThemes> themes;
 
     // get and set the theme to be persisted
     void setTheme(std::string theme) { this->theme = theme; }
     std::string getTheme() { return theme; }
 
-    // access tot he themes engine for the ModuleWidget
-    svg_theme::SvgThemes& getThemes() { return themes; }
+    // access to the themes engine for the ModuleWidget.
+    // Only valid after initThemes() returns true.
+    svg_theme::SvgThemes& getThemes() { return *themes; }
 
     // initThemes must be called to load themes.
     // It can be safely called multiple times and it only loads the first time.
     // In other words, it is "lazy" or just-in-time initialization.
+    // The themes are loaded once and shared by every Demo module in the patch.
     bool initThemes()
     {
-        return themes.isLoaded()
-            ? true
-            : themes.load(asset::plugin(pluginInstance, "res/Demo-themes.json"));
+        if (!themes) {
+            themes = svg_theme::ThemeRegistry::acquire(asset::plugin(pluginInstance, "res/Demo-themes.json"),
+                [](svg_theme::SvgThemes& themes) {
+                    // For demo and authoring purposes, we log to the Rack log.
+                    //
+                    // In a production VCV Rack module in the library, logging to Rack's log is disallowed.
+                    // The logging is necessary only when authoring your theme and SVG.
+                    // Once your theme is correctly applying to the SVG, you do not need this logging
+                    // because it's useless to anyone other than someone modifying the SVG or theme.
+                    //
+                    themes.setLog([](svg_theme::Severity severity, svg_theme::ErrorCode code, std::string info)->void {
+                        DEBUG("Theme %s (%d): %s", SeverityName(severity), code, info.c_str());
+                    });
+                });
+        }
+        return themes != nullptr;
     }
 
 
@@ -63,6 +65,15 @@ struct  DemoModuleWidget : ModuleWidget, svg_theme::IThemeHolder
 {
     DemoModule* my_module = nullptr;
     std::string panelFilename;
+    // The panel's own copy of Demo.svg, and the ThemedImage that themes it
+    // in place. The ThemedImage goes first, as it must not outlive the copy.
+    std::shared_ptr<svg_theme::SvgVariant> panelSvg;
+    std::unique_ptr<svg_theme::ThemedImage> panelImage;
+    // The themeable widgets, registered as they are added
+    svg_theme::ThemeDispatcher dispatcher;
+    // The themes version the SVGs were last prewarmed for
+    bool prewarmed = false;
+    unsigned int prewarmed_version = 0;
 
     DemoModuleWidget(DemoModule* module)
     {
@@ -75,10 +86,12 @@ struct  DemoModuleWidget : ModuleWidget, svg_theme::IThemeHolder
         // contain the element ids required for targeting.
         // Here we've copied the Rack screws, added ids, and created our own screw subclass: "ThemeScrew".
         // See `widgets.hpp` for the definition of a ThemeScrew.
-        addChild(createWidget<ThemeScrew>(Vec(RACK_GRID_WIDTH, 0)));
-        addChild(createWidget<ThemeScrew>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
-        addChild(createWidget<ThemeScrew>(Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
-        addChild(createWidget<ThemeScrew>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+        // Each one is registered with the dispatcher, so that theme changes
+        // go straight to the themeable widgets without searching the widget tree.
+        addChild(dispatcher.adopt(createWidget<ThemeScrew>(Vec(RACK_GRID_WIDTH, 0))));
+        addChild(dispatcher.adopt(createWidget<ThemeScrew>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0))));
+        addChild(dispatcher.adopt(createWidget<ThemeScrew>(Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH))));
+        addChild(dispatcher.adopt(createWidget<ThemeScrew>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH))));
 
         if (my_module && !isDefaultTheme()) {
             // only initialize themes and modify the svg when the current hteme is not the default theme
@@ -109,44 +122,108 @@ struct  DemoModuleWidget : ModuleWidget, svg_theme::IThemeHolder
         auto panel = dynamic_cast<rack::app::SvgPanel*>(getPanel());
         if (!panel) return;
 
-        my_module->initThemes(); // load themes as necessary
-        auto themes = my_module->getThemes();
+        if (!my_module->initThemes()) return; // load themes as necessary
+        auto& themes = my_module->getThemes();
         auto svg_theme = themes.getTheme(theme);
+        if (!svg_theme) {
+            // The theme was renamed or removed from the themes file while authoring.
+            theme = "Light";
+            svg_theme = themes.getTheme(theme);
+            if (!svg_theme) return;
+        }
 
         // For demo purposes, we are using a stock Rack SVGPanel
         // which does not implement IApplyTheme.so here we do it manually.
         // This shows how to apply themeing without implementing IApplyTheme
         // and using ApplyChildrenTheme.
-        std::shared_ptr<Svg> newSvg = panel->svg;
-        if (themes.applyTheme(svg_theme, panelFilename, newSvg)) {
-			panel->setBackground(newSvg);
+        // The panel gets its own copy of Demo.svg (sharing the paths of the
+        // unthemed original), wrapped in a ThemedImage. The first theme
+        // binds a plan of the panel's themed shapes, and after that a theme
+        // switch only touches the shapes whose style differs.
+        if (!panelImage) {
+            panelSvg = svg_theme::SvgVariant::create(svg_theme::ThemeCacheManager::of(themes).svgCache().getMaster(panelFilename));
+            if (panelSvg) {
+                panelImage.reset(new svg_theme::ThemedImage(panelSvg->handle));
+                panel->setBackground(panelSvg);
+            }
+        }
+        if (panelImage && themes.applyThemeDelta(panelImage->getTheme(), svg_theme, *panelImage)) {
             // The SVG was changed, so we need to tell the widget to redraw
-            EventContext ctx;
-            DirtyEvent dirt;
-            dirt.context = &ctx;
-            panel->onDirty(dirt);
+            dirtyPanel();
         }
         // The preferred procedure is to subclass any widget you want to theme,
         // implementing IApplyTheme (which is quite simple to do in most cases),
-        // and use this helper to apply the theme to the widget hierarchy.
-        ApplyChildrenTheme(this, themes, svg_theme);
+        // and register it with a ThemeDispatcher when adding it.
+        // The dispatcher themes each SVG file once: the four screws
+        // share a single themed Screw.svg.
+        // Without a dispatcher, ApplyChildrenTheme or ApplyChildrenThemeBatch
+        // find the themeable widgets by searching the widget hierarchy.
+        dispatcher.applyTheme(themes, svg_theme);
 
         // Let the module know what the new theme is so that it will be remembered.
         my_module->setTheme(theme);
     }
 
+    void dirtyPanel()
+    {
+        auto panel = getPanel();
+        if (!panel) return;
+        EventContext ctx;
+        DirtyEvent dirt;
+        dirt.context = &ctx;
+        panel->onDirty(dirt);
+    }
+
+#ifdef SVG_THEME_AUTHORING
+    // While authoring, edits to the themes file show up without restarting Rack.
+    // Build with `make FLAGS+=-DSVG_THEME_AUTHORING` to turn it on; a release
+    // build has no reason to poll the file.
+    // The check is throttled inside reload(), so it's fine to call every frame.
+    // The themes are shared, so compare versions: only the module that
+    // happened to call reload() first sees it return true.
+    unsigned int themes_version = 0;
+
+    void step() override
+    {
+        ModuleWidget::step();
+        if (!my_module || !my_module->themes) return;
+        auto& themes = my_module->getThemes();
+        themes.reload();
+        if (themes.getVersion() != themes_version) {
+            themes_version = themes.getVersion();
+            setTheme(getTheme());
+            // The reload already re-applied the theme to the panel's
+            // ThemedImage, so setTheme finds nothing to change there.
+            dirtyPanel();
+        }
+    }
+#endif
+
     void appendContextMenu(Menu *menu) override
     {
         if (!my_module) return;
         if (!my_module->initThemes()) return;
-        auto themes = my_module->getThemes();
+        auto& themes = my_module->getThemes();
         if (!themes.isLoaded()) return; // Can't load themes, so no menu to display
 
+        // Load and theme the SVGs for every theme in the background while the
+        // menu is open, so that choosing a theme is just a cache lookup.
+        // This is needed once per load of the themes, not each time the menu
+        // opens, and SVGs already cached or in the works are skipped anyway.
+        // This never parses a theme: with lazy loading, unparsed themes are skipped.
+        if (!prewarmed || prewarmed_version != themes.getVersion()) {
+            svg_theme::PrewarmThemedSvgs(themes, { panelFilename, asset::plugin(pluginInstance, "res/Screw.svg") }, themes.getThemeNames());
+            prewarmed = true;
+            prewarmed_version = themes.getVersion();
+        }
+
         // Good practice to separate your module's menus from the Rack menus
         menu->addChild(new MenuSeparator); 
 
-        // add the "Theme" menu
-        svg_theme::AppendThemeMenu(menu, this, themes);
+        // add the "Theme" menu, with a thumbnail of the panel in each theme.
+        // The thumbnails are rendered in the background from the SVGs prewarmed above,
+        // and show up as they're ready.
+        svg_theme::AppendThemeMenu(menu, this, themes, panelFilename);
     }
 };
 
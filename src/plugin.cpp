@@ -1,4 +1,5 @@
 #include "plugin.hpp"
+#include "../svt_rack.hpp"
 using namespace ::rack;
 
 Plugin* pluginInstance;
@@ -12,3 +13,8 @@ void init(Plugin* p) {
 	// Any other plugin initialization may go here.
 	// As an alternative, consider lazy-loading assets and lookup tables when your module is created to reduce startup times of Rack.
 }
+
+void destroy() {
+	// Join the theme worker threads before the plugin library is unloaded.
+	svg_theme::ThemeWorkerPool::instance().shutdown();
+}
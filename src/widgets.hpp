@@ -1,6 +1,7 @@
 #include <rack.hpp>
 #include "plugin.hpp"
 #include "../svgtheme.hpp"
+#include "../svt_rack.hpp"
 
 using namespace rack;
 
@@ -9,7 +10,7 @@ using namespace rack;
 // plus the complete implementation of IApplyTheme so that the module widget can
 // call a single helper to update the entire UI of the module with a new theme.
 //
-struct ThemeScrew : app::SvgScrew, svg_theme::IApplyTheme
+struct ThemeScrew : app::SvgScrew, svg_theme::IApplyTheme, svg_theme::IThemeTargets
 {
     ThemeScrew()
     {
@@ -19,6 +20,17 @@ struct ThemeScrew : app::SvgScrew, svg_theme::IApplyTheme
     // implement IApplyTheme
     bool applyTheme(svg_theme::SvgThemes& themes, std::shared_ptr<svg_theme::Theme> theme) override
     {
-        return themes.applyTheme(theme, asset::plugin(pluginInstance, "res/Screw.svg"), sw->svg);
+        std::shared_ptr<Svg> svg = sw->svg;
+        if (!svg_theme::ApplyThemeToSvg(themes, theme, asset::plugin(pluginInstance, "res/Screw.svg"), svg)) return false;
+        // Through setSvg, so that the screw's size follows the SVG
+        setSvg(svg);
+        return true;
+    }
+
+    // implement IThemeTargets, so that all screws share one themed SVG
+    void addThemeTargets(svg_theme::ThemeBatch& batch) override
+    {
+        batch.add(asset::plugin(pluginInstance, "res/Screw.svg"), sw->svg,
+            [this](std::shared_ptr<Svg> svg) { setSvg(svg); }, this);
     }
 };
@@ -1,32 +1,71 @@
-// svgtheme.hpp - lightweight SVG themeing based on nanosvg,
+// svgtheme.hpp - lightweight SVG theming based on nanosvg,
 // designed primarily for VCV Rack.
 //
 // See the end of this file for copyright and license information.
 
 // VCV Rack-specific functionality is provided by also including 
-// `svt_rack.hpp` as shown in the followong example.
+// `svt_rack.hpp` as shown in the following example.
 //
 // One source file in your project must contain:
 //
 // ```cpp
 // #define IMPLEMENT_SVG_THEME
-// #include "svg_theme.hpp" // this file
+// #include "svgtheme.hpp" // this file
 // #include "svt_rack.hpp" // VCV-Rack helpers
 // ```
 
 #ifndef SVG_THEME_H
 #define SVG_THEME_H
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <condition_variable>
 #include <functional>
+#include <locale>
+#include <map>
 #include <memory>
+#include <stdexcept>
+#include <sstream>
 #include <string>
+#include <tuple>
 #include <cstring>
+#include <cstdint>
+#include <mutex>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <nanosvg.h>
+#ifdef IMPLEMENT_SVG_THEME
 #include <jansson.h>
-#include <rack.hpp>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SVG_THEME_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#endif
+
+// The theme engine doesn't depend on VCV Rack (or on Jansson outside the
+// implementation), so it's cheap to include and usable in offline tools.
+// The Rack-specific parts are in svt_rack.hpp.
+struct json_t;
 
 namespace svg_theme {
 
@@ -51,28 +90,110 @@ enum ErrorCode {
     ThemeExpected                = 11,
     InvalidHexColor              = 12,
     OneOfColorOrGradient         = 13,
-    TwoGradientStopsMax          = 14,
-    GradientStopIndexZeroOrOne   = 15,
+    TooManyGradientStops         = 14,
+    GradientStopIndexOutOfRange  = 15,
     GradientStopNotPresent       = 16,
     RemovingGradientNotSupported = 17,
     GradientNotPresent           = 18,
+    CannotOpenCompiledFile       = 19,
+    InvalidCompiledFile          = 20,
+    CannotWriteCompiledFile      = 21,
+    UnknownTheme                 = 22,
+    UnknownStyle                 = 23,
+
+    // Former names
+    TwoGradientStopsMax          = TooManyGradientStops,
+    GradientStopIndexZeroOrOne   = GradientStopIndexOutOfRange,
 };
 
 // logging callback function you provide.
 typedef std::function<void(Severity severity, ErrorCode code, std::string info)> LogCallback;
 
+// printf-style formatting to a std::string.
+std::string format_string(const char *fmt, ...);
+
+// Parse a hex color: "#rgb", "#rgba", "#rrggbb", or "#rrggbbaa".
+// Returns false, leaving `color` unchanged, if the text is not a valid color.
+// Does not allocate.
+bool ParseHexColor(const char * text, size_t length, PackedColor& color);
+
+// Parse a batch of hex colors, using SSE2 where available, for callers that
+// have many colors at hand at once, such as a palette or a table of styles.
+// The loaders parse each color as they read it, with ParseHexColor.
+// colors[i] is set to the parsed color, or opaque black if texts[i] is not a
+// valid color. `valid` is optional, and set to whether each color was valid.
+// Returns the number of valid colors. Does not allocate.
+size_t ParseHexColors(const char * const * texts, const size_t * lengths, size_t count, PackedColor * colors, bool * valid);
+
+// The value of a hex digit, or -1.
+constexpr int hex_value(unsigned char ch) {
+    return (ch >= '0' && ch <= '9') ? ch - '0'
+        : (ch >= 'A' && ch <= 'F') ? 10 + ch - 'A'
+        : (ch >= 'a' && ch <= 'f') ? 10 + ch - 'a'
+        : -1;
+}
+
+constexpr PackedColor PackRGB(unsigned int r, unsigned int g, unsigned int b) {
+    return r | (g << 8) | (b << 16) | (255u << 24);
+}
+constexpr PackedColor PackRGBA(unsigned int r, unsigned int g, unsigned int b, unsigned int a) {
+    return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+constexpr unsigned int HexNibble(char ch) {
+    return hex_value(static_cast<unsigned char>(ch)) >= 0
+        ? static_cast<unsigned int>(hex_value(static_cast<unsigned char>(ch)))
+        : throw std::invalid_argument("invalid hex digit in color");
+}
+constexpr unsigned int HexByte(const char * text, size_t i) {
+    return (HexNibble(text[i]) << 4) | HexNibble(text[i + 1]);
+}
+
+// A hex color evaluated at compile time when used in a constant expression,
+// with the same syntax and result as ParseHexColor.
+// An invalid color fails to compile (or throws, at run time).
+constexpr PackedColor HexColor(const char * text, size_t length) {
+    return text[0] != '#' ? throw std::invalid_argument("hex color must start with '#'")
+        : length == 1 + 3 ? PackRGB(HexNibble(text[1]) << 4, HexNibble(text[2]) << 4, HexNibble(text[3]) << 4)
+        : length == 1 + 4 ? PackRGBA(HexNibble(text[1]) << 4, HexNibble(text[2]) << 4, HexNibble(text[3]) << 4, HexNibble(text[4]) << 4)
+        : length == 1 + 6 ? PackRGB(HexByte(text, 1), HexByte(text, 3), HexByte(text, 5))
+        : length == 1 + 8 ? PackRGBA(HexByte(text, 1), HexByte(text, 3), HexByte(text, 5), HexByte(text, 7))
+        : throw std::invalid_argument("hex color must be #rgb, #rgba, #rrggbb, or #rrggbbaa");
+}
+
+inline namespace literals {
+// constexpr PackedColor c = "#4086bf80"_hex;
+constexpr PackedColor operator"" _hex(const char * text, size_t length) {
+    return HexColor(text, length);
+}
+}
+
 struct GradientStop {
     int index = -1;
     float offset = 0.f;
     PackedColor color = 0;
  
-    GradientStop() {}
-    GradientStop(int i, float off, PackedColor co)  : index(i), offset(off), color(co) {}
+    constexpr GradientStop() {}
+    constexpr GradientStop(int i, float off, PackedColor co)  : index(i), offset(off), color(co) {}
 };
 
+// The most stops a gradient in a theme can have.
+// Every Paint has room for this many, so keep it small.
+constexpr int MAX_GRADIENT_STOPS = 4;
+
 struct Gradient {
     int nstops = 0;
-    GradientStop stops[2];
+    // In order of index, with no index repeated.
+    GradientStop stops[MAX_GRADIENT_STOPS];
+
+    constexpr Gradient() {}
+    // Gradient(stop0), Gradient(stop0, stop1), ... with the stops in order of index.
+    template <typename... Stops>
+    constexpr Gradient(GradientStop stop, Stops... more) : nstops(1 + sizeof...(Stops)), stops{stop, more...} {}
+
+    // Add a stop, or replace the stop with the same index.
+    // Returns false if the index is out of range (0 to MAX_GRADIENT_STOPS - 1).
+    bool setStop(const GradientStop& stop);
 };
 
 enum class PaintKind { Unset, Color, Gradient, None };
@@ -83,12 +204,15 @@ class Paint {
         Gradient gradient;
     };
 
+    constexpr Paint(PaintKind kind, PackedColor color) : kind(kind), color(color) {}
+
 public:
-    Paint() {}
-    Paint(PackedColor color) { setColor(color); }
-    Paint(const Gradient& gradient) { setGradient(gradient); }
+    constexpr Paint() : color(0) {}
+    constexpr Paint(PackedColor color) : kind(PaintKind::Color), color(color) {}
+    constexpr Paint(const Gradient& gradient) : kind(PaintKind::Gradient), gradient(gradient) {}
+    static constexpr Paint none() { return Paint(PaintKind::None, 0); }
 
-    PaintKind Kind() { return kind; }
+    PaintKind Kind() const { return kind; }
     void setColor(PackedColor new_color) {
         kind = PaintKind::Color;
         color = new_color;
@@ -100,12 +224,16 @@ public:
     void setNone() {
         kind = PaintKind::None;
     }
-    bool isColor() { return kind == PaintKind::Color; }
-    bool isGradient() { return kind == PaintKind::Gradient; }
-    bool isNone()  { return kind == PaintKind::None; }
-    PackedColor getColor() { return isColor() ? color : 0; }
-    const Gradient* getGradient() { return isGradient() ? &gradient : nullptr; }
-    bool isApplicable() { return kind != PaintKind::Unset; }
+    bool isColor() const { return kind == PaintKind::Color; }
+    bool isGradient() const { return kind == PaintKind::Gradient; }
+    bool isNone() const { return kind == PaintKind::None; }
+    PackedColor getColor() const { return isColor() ? color : 0; }
+    const Gradient* getGradient() const { return isGradient() ? &gradient : nullptr; }
+    bool isApplicable() const { return kind != PaintKind::Unset; }
+
+    // true if applying either paint has the same effect.
+    bool operator==(const Paint& other) const;
+    bool operator!=(const Paint& other) const { return !(*this == other); }
 };
 
 struct Style {
@@ -116,6 +244,16 @@ struct Style {
     bool apply_stroke_width = false;
     bool apply_opacity = false;
 
+    constexpr Style() {}
+    constexpr explicit Style(Paint fill, Paint stroke = Paint()) : fill(fill), stroke(stroke) {}
+    // For constant styles: Style(fill, stroke).withOpacity(0.5f).withStrokeWidth(1.5f)
+    constexpr Style withOpacity(float alpha) const {
+        return Style(fill, stroke, alpha, stroke_width, apply_stroke_width, true);
+    }
+    constexpr Style withStrokeWidth(float width) const {
+        return Style(fill, stroke, opacity, width, true, apply_opacity);
+    }
+
     void setFill(Paint paint) { fill = paint; }
     void setStroke(Paint paint) { stroke = paint; }
     void setOpacity(float alpha) {
@@ -126,54 +264,553 @@ struct Style {
         stroke_width = width;
         apply_stroke_width = true;
     }
-    bool isApplyFill() { return fill.isApplicable(); }
-    bool isApplyStroke() { return stroke.isApplicable(); }
-    bool isApplyOpacity() { return apply_opacity; }
-    bool isApplyStrokeWidth() { return apply_stroke_width; }
+    bool isApplyFill() const { return fill.isApplicable(); }
+    bool isApplyStroke() const { return stroke.isApplicable(); }
+    bool isApplyOpacity() const { return apply_opacity; }
+    bool isApplyStrokeWidth() const { return apply_stroke_width; }
+    // true if applying the style can change anything
+    bool isApplicable() const {
+        return isApplyFill() || isApplyStroke() || apply_opacity || apply_stroke_width;
+    }
+
+    // true if applying either style has the same effect.
+    // Values that are not applied are not compared.
+    bool operator==(const Style& other) const;
+    bool operator!=(const Style& other) const { return !(*this == other); }
+
+private:
+    constexpr Style(Paint fill, Paint stroke, float opacity, float stroke_width, bool apply_stroke_width, bool apply_opacity)
+        : fill(fill), stroke(stroke), opacity(opacity), stroke_width(stroke_width),
+          apply_stroke_width(apply_stroke_width), apply_opacity(apply_opacity) {}
+};
+
+// An entry in a static table of styles, for themes built into a plugin.
+// See SvgThemes::addTheme.
+struct StyleEntry {
+    const char * tag;
+    Style style;
+};
+
+// A non-owning view of a tag, such as the tag suffix of a shape id.
+struct TagView {
+    const char * text = nullptr;
+    size_t length = 0;
+
+    TagView() {}
+    TagView(const char * text, size_t length) : text(text), length(length) {}
+    TagView(const std::string& tag) : text(tag.c_str()), length(tag.size()) {}
+
+    bool empty() const { return 0 == length; }
+    std::string str() const { return std::string(text, length); }
+};
+
+// An open addressed hash index of dense ids, assigned 0, 1, 2... as they are
+// added. The owner keeps the values by id, and says which id matches when
+// finding. Used by TagTable and StylePool.
+class HashIndex {
+    std::vector<unsigned int> hashes; // by id
+    std::vector<int> slots; // open addressed, power of two size, -1 when empty
+
+    void rehash(size_t capacity);
+public:
+    // Return the id with this hash for which `equal(id)` is true, or -1.
+    template <typename Equal>
+    int find(unsigned int hash, Equal equal) const {
+        if (slots.empty()) return -1;
+        size_t mask = slots.size() - 1;
+        for (size_t slot = hash & mask; slots[slot] >= 0; slot = (slot + 1) & mask) {
+            int id = slots[slot];
+            if (hashes[id] == hash && equal(id)) return id;
+        }
+        return -1;
+    }
+    // Add the next id, with this hash, and return it.
+    int add(unsigned int hash);
+    // Make room for `count` ids in all without rehashing.
+    void reserve(size_t count);
+    size_t size() const { return hashes.size(); }
+};
+
+// Interns tag names to dense integer ids.
+// Lookup by TagView hashes the characters in place and does not allocate.
+class TagTable {
+    std::vector<std::string> names;
+    HashIndex index;
+
+    int find(TagView tag, unsigned int hash) const;
+public:
+    // Return the id of the tag, or -1 if the tag is unknown.
+    int find(TagView tag) const;
+    // Return the id of the tag, adding it if necessary.
+    int intern(TagView tag);
+    size_t size() const { return names.size(); }
+    const std::string& name(int id) const { return names[id]; }
+};
+
+// Get the tag of a shape: the part of the id following the last "--",
+// or the whole id when there is no "--".
+TagView GetTagView(const NSVGshape* shape);
+
+// Immutable Styles shared by all the themes of an SvgThemes.
+// Equal styles (see Style::operator==) are stored once, so memory scales with
+// the number of distinct styles rather than the number of themes and tags.
+// Styles are never removed or moved, so their addresses stay valid as long
+// as the pool.
+class StylePool {
+    // Styles are stored in chunks that double in size, so adding n styles
+    // takes O(log n) allocations and never moves a Style.
+    std::vector<std::unique_ptr<Style[]>> chunks;
+    Style* next = nullptr;
+    size_t available = 0;
+    std::vector<const Style*> styles; // by id
+    HashIndex index;
+public:
+    // Return the pooled instance equal to `style`, adding it if necessary.
+    const Style* intern(const Style& style);
+    // Make room for `count` more styles without rehashing.
+    void reserve(size_t count);
+    size_t size() const { return styles.size(); }
 };
 
 struct Theme {
     std::string name;
     std::string file;
-    std::unordered_map<std::string, std::shared_ptr<Style>> styles;
+    // Incremented each time SvgThemes::reload replaces the styles, so that
+    // anything themed with an earlier version can tell it is out of date.
+    unsigned int version = 0;
+    // Tag ids are shared by all themes loaded by the same SvgThemes.
+    std::shared_ptr<TagTable> tags;
+    // The pool holding the styles, shared like the tags.
+    std::shared_ptr<StylePool> pool;
+    // Pooled styles indexed by tag id, or nullptr where the theme does not
+    // style the tag. Themes with the same style for a tag share the instance.
+    std::vector<const Style*> styles;
+
+    // Find the style for a tag without allocating. Returns nullptr if not styled.
+    const Style* findStyle(TagView tag) const {
+        if (!tags) return nullptr;
+        return findStyle(tags->find(tag));
+    }
+    const Style* findStyle(int tag_id) const {
+        if (tag_id < 0 || tag_id >= static_cast<int>(styles.size())) return nullptr;
+        return styles[tag_id];
+    }
+
+    const Style* getStyle(const std::string& name) const {
+        return findStyle(TagView(name));
+    }
 
-    std::shared_ptr<Style> getStyle(std::string name) {
-        auto found = styles.find(name);
-        if (found != styles.end()) {
-            return found->second;
+    void setStyle(int tag_id, const Style& style) {
+        if (!pool) pool = std::make_shared<StylePool>();
+        setStyle(tag_id, style.isApplicable() ? pool->intern(style) : nullptr);
+    }
+    // Set a style that is already in this theme's pool.
+    void setStyle(int tag_id, const Style* style) {
+        if (tag_id >= static_cast<int>(styles.size())) {
+            styles.resize(tag_id + 1, nullptr);
         }
-        return nullptr;
+        styles[tag_id] = style;
+    }
+    // Take the base theme's style for each tag this theme doesn't style.
+    void inherit(const Theme& base) {
+        if (styles.size() < base.styles.size()) {
+            styles.resize(base.styles.size(), nullptr);
+        }
+        for (size_t id = 0; id < base.styles.size(); ++id) {
+            if (!styles[id]) styles[id] = base.styles[id];
+        }
+    }
+};
+
+struct ThemeDelta;
+
+// A Theme bound to a specific NSVGimage: the themed shapes of the image,
+// each paired with its resolved Style.
+// Binding walks the shapes and looks up the tags once, so re-applying the
+// theme touches only the themed shapes, with no tag extraction or lookup.
+struct ApplyPlan {
+    struct Entry {
+        NSVGshape* shape;
+        const Style* style;
+        int tag; // tag id in the theme's TagTable
+        int index; // the shape's position among the image's shapes
+    };
+    std::shared_ptr<Theme> theme;
+    // Keeps the styles alive, even once a reload has given the theme new ones
+    std::shared_ptr<StylePool> pool;
+    NSVGimage* svg = nullptr;
+    std::vector<Entry> entries;
+    // For a plan switching from one theme to another, the delta, which
+    // keeps the `from` theme alive too.
+    std::shared_ptr<ThemeDelta> delta;
+};
+
+// The tags whose styles differ between two themes sharing a TagTable.
+// Switching an image from one theme to the other only needs to touch shapes
+// with these tags.
+struct ThemeDelta {
+    std::shared_ptr<Theme> from;
+    std::shared_ptr<Theme> to;
+    std::vector<int> tags;
+    std::vector<bool> changed; // indexed by tag id
+
+    bool isChanged(int tag_id) const {
+        return tag_id >= 0 && tag_id < static_cast<int>(changed.size()) && changed[tag_id];
+    }
+};
+
+// Estimated heap size of a parsed image, in bytes.
+// Paths shared with `master` (see CloneImageVariant) are not counted.
+size_t ImageBytes(const NSVGimage* svg, const NSVGimage* master = nullptr);
+
+// Deep copy an image: shapes, paths, and gradients.
+// The copy is allocated the way nanosvg allocates, so it is freed with nsvgDelete.
+// Returns nullptr if the source is null or memory is exhausted.
+NSVGimage* CloneImage(const NSVGimage* source);
+
+// Copy an image's shapes and gradients, sharing the source's paths, which
+// theming never changes. The variant is a single allocation, a fraction of
+// the size of a deep copy for geometry-heavy images.
+// Free it with DeleteImageVariant, not nsvgDelete, and don't let it outlive
+// the source.
+// Returns nullptr if the source is null or memory is exhausted.
+NSVGimage* CloneImageVariant(const NSVGimage* source);
+void DeleteImageVariant(NSVGimage* variant);
+
+// The gradients of one image that themes have changed, so that a theme can
+// turn a color into a gradient and back, or give a gradient more stops,
+// without leaking.
+// The image's own paints are set aside while a theme replaces them.
+// Gradients the image didn't have come from the arena, and are recycled
+// when a theme removes them, so memory is bounded by the number of paints.
+// Keep one with the image it themes, as ThemedImage and SvgVariant do, so
+// the paints it has set aside are never matched against another image.
+// Paints are identified by their slot in the image (see PaintSlot), so the
+// arena keeps its bookkeeping in a vector rather than a hash map.
+// Call restore() before the image is deleted, to put back its own gradients
+// for nsvgDelete to free. Destroying the arena restores the image too, so
+// an arena that is destroyed first needs no call.
+class GradientArena
+{
+public:
+    GradientArena() {}
+    GradientArena(const GradientArena&) = delete;
+    GradientArena& operator=(const GradientArena&) = delete;
+    ~GradientArena();
+
+    // The slot of a paint: twice the position of its shape among the
+    // image's shapes (ApplyPlan::Entry::index), plus one for the stroke.
+    static size_t PaintSlot(int shape_index, bool stroke) {
+        return 2 * static_cast<size_t>(shape_index) + (stroke ? 1 : 0);
     }
+
+    // Make `paint`, in `slot`, a gradient with at least `nstops` stops.
+    // This is the image's own gradient for the paint if it has enough stops.
+    // Otherwise it's one from the arena, with the geometry and stops of the
+    // paint's current or own gradient or, if it has neither, a linear
+    // gradient from left to right across `bounds` (the shape's bounds).
+    // Returns false if memory is exhausted.
+    bool setGradient(NSVGpaint& paint, size_t slot, int nstops, const float* bounds);
+    // Call before setting a gradient `paint` to a color or none.
+    void releaseGradient(NSVGpaint& paint, size_t slot);
+    // Put back the image's own paints, and recycle the arena's gradients.
+    void restore();
+    // Recycle the arena's gradients and forget the image's own paints,
+    // after they have been put back some other way.
+    void reset();
+    // Gradients allocated, in use or free.
+    size_t size() const { return allocated; }
+
+private:
+    struct Slot {
+        NSVGpaint* paint = nullptr; // set while the image's own paint is set aside
+        NSVGpaint original;
+        NSVGgradient* gradient = nullptr; // the arena's gradient in use by the paint
+    };
+    std::vector<Slot> slots; // by paint slot
+    std::vector<NSVGgradient*> spare;
+    size_t allocated = 0;
+
+    void keepOriginal(Slot& entry, NSVGpaint& paint);
+    void recycle(Slot& entry);
+};
+
+// A snapshot of what theming has cost an SvgThemes, from SvgThemes::getStats.
+// Times are cumulative wall-clock nanoseconds.
+struct ThemeStats {
+    // load, loadStreaming and loadCompiled, including reloads
+    uint64_t loads = 0;
+    uint64_t load_ns = 0;
+    // Themes parsed on first use, in lazy mode
+    uint64_t theme_parses = 0;
+    uint64_t theme_parse_ns = 0;
+    // bindTheme, with the shapes it visited and the shapes that have a style
+    // (which also count those of applyTheme(theme, NSVGimage*))
+    uint64_t binds = 0;
+    uint64_t bind_ns = 0;
+    uint64_t shapes_visited = 0;
+    uint64_t styles_matched = 0;
+    // applyPlan, however it's called, with the styled shapes it applied and
+    // the attributes that changed (which also count those of
+    // applyTheme(theme, NSVGimage*))
+    uint64_t plans_applied = 0;
+    uint64_t shapes_applied = 0;
+    uint64_t attributes_changed = 0;
+    // applyTheme(theme, NSVGimage*) and applyTheme(theme, ThemedImage&)
+    uint64_t applies = 0;
+    uint64_t apply_ns = 0;
+    // applyThemeDelta
+    uint64_t delta_applies = 0;
+    uint64_t delta_apply_ns = 0;
+    // ApplyThemeToSvg (in svt_rack.hpp), and its themed SVG cache hits and misses
+    uint64_t file_applies = 0;
+    uint64_t file_apply_ns = 0;
+    uint64_t file_cache_hits = 0;
+    uint64_t file_cache_misses = 0;
+    // restoreDefault
+    uint64_t restores = 0;
+    uint64_t restore_ns = 0;
+    // Jobs run on worker threads by PrewarmThemedSvgs and RequestThemePreviews
+    uint64_t background_jobs = 0;
+    uint64_t background_ns = 0;
+    // Previews rasterized, as part of those jobs
+    uint64_t previews_rendered = 0;
+    uint64_t preview_ns = 0;
+
+    // The stats as a single-line JSON object, named as above, or `{}` when
+    // the implementation doesn't count them.
+    std::string toJson() const;
+};
+
+class JsonReader;
+class SvgThemes;
+
+// Work that helpers built on SvgThemes (such as those in svt_rack.hpp) do
+// for it, attached with SvgThemes::setExtension, so that the SvgThemes can
+// wait for it and report it without knowing how it's done.
+class ThemeExtension
+{
+public:
+    virtual ~ThemeExtension() {}
+    // Wait until the extension's background work is done.
+    virtual void wait() {}
+    // Add the extension's counts to stats.
+    virtual void addStats(ThemeStats& stats) const { (void)stats; }
+    virtual void resetStats() {}
 };
 
+// A file's modification time and size, to tell when it has changed.
+// A missing file has the default stamp.
+struct FileStamp {
+    int64_t mtime = 0;
+    int64_t size = -1;
+    bool operator==(const FileStamp& other) const { return mtime == other.mtime && size == other.size; }
+    bool operator!=(const FileStamp& other) const { return !(*this == other); }
+};
+// Get the stamp of a file. Returns false, leaving `stamp` unchanged, if the
+// file can't be found.
+bool GetFileStamp(const std::string& filename, FileStamp& stamp);
+
+// An NSVGimage you theme in place, with the plans bound to it, so that
+// applying a theme again is a tight loop over the themed shapes (see
+// SvgThemes::applyTheme(theme, ThemedImage&)).
+// What's kept for the image lives here, so it goes when the ThemedImage
+// goes: keep one as long as you theme the image, and destroy it before
+// deleting the image.
+class ThemedImage
+{
+public:
+    explicit ThemedImage(NSVGimage* svg) : svg(svg) {}
+    ~ThemedImage();
+    ThemedImage(const ThemedImage&) = delete;
+    ThemedImage& operator=(const ThemedImage&) = delete;
+
+    NSVGimage* image() const { return svg; }
+    // The theme last applied, or nullptr if none or after restoreDefault.
+    std::shared_ptr<Theme> getTheme() const { return current; }
+
+private:
+    friend class SvgThemes;
+    NSVGimage* svg;
+    SvgThemes* owner = nullptr; // the SvgThemes that themed it, which re-applies it on reload
+    std::shared_ptr<Theme> current;
+    // Plans keyed by `from` theme and `to` theme.
+    // Full plans have a null `from`; delta plans bind only the changed shapes.
+    std::map<std::pair<const Theme*, const Theme*>, std::shared_ptr<ApplyPlan>> plans;
+    // The authored values of the attributes a theme can change, for each
+    // tagged shape, captured before the image is first themed.
+    // Parallel arrays, so restoring them is a linear pass.
+    struct Defaults {
+        bool captured = false;
+        std::vector<NSVGshape*> shape;
+        std::vector<float> opacity;
+        std::vector<float> stroke_width;
+        std::vector<NSVGpaint> fill;
+        std::vector<NSVGpaint> stroke;
+        // The gradients of those shapes, with their stops packed in order.
+        std::vector<NSVGgradient*> own_gradients;
+        std::vector<NSVGgradientStop> stops;
+    };
+    Defaults defaults;
+    // Gradients added by themes.
+    GradientArena gradients;
+};
 
 class SvgThemes
 {
 public:
+    SvgThemes();
+    ~SvgThemes();
+    // An SvgThemes holds all the loaded themes, so it is not copyable.
+    // Share one by reference, or through ThemeRegistry.
+    SvgThemes(const SvgThemes&) = delete;
+    SvgThemes& operator=(const SvgThemes&) = delete;
 
     // Set a logging callback to receive more detailed information, warnings,
     // and errors when working with svg themes.
-    void setLog(LogCallback log) { this->log = log; }
+    // Messages less severe than `min_severity` are not formatted or sent.
+    // With no callback set (the default), nothing is formatted.
+    void setLog(LogCallback log, Severity min_severity = Severity::Info) {
+        this->log = log;
+        this->log_level = min_severity;
+    }
+
+    // true if a message of this severity would be sent to the log callback.
+    bool isLogging(Severity severity) const { return log && severity >= log_level; }
 
     // load themes from the specified file.
     bool load(const std::string& filename);
 
+    // In lazy mode, load() only checks the JSON syntax and records the name
+    // and location of each theme. A theme's styles are parsed the first time
+    // getTheme asks for it, so startup cost scales with the themes used.
+    // Errors in a theme's styles are then reported by getTheme, which
+    // returns nullptr and drops the theme.
+    // Call before load().
+    void setLazy(bool lazy) { this->lazy = lazy; }
+
+    // Load themes from the specified file, like load(), but reading the file
+    // as a stream of tokens that build each Theme and Style as they arrive,
+    // instead of parsing the whole file into a Jansson DOM first.
+    // Peak memory is the themes plus a small read buffer.
+    bool loadStreaming(const std::string& filename);
+
+    // Load themes from a binary file written by saveCompiled, usually by
+    // the offline compiler in tools/svt_compile.cpp.
+    // The file is memory-mapped and the themes are built directly from it,
+    // with no parsing. Keep the JSON as the authoring format, and recompile
+    // whenever it changes.
+    bool loadCompiled(const std::string& filename);
+
+    // Write the loaded themes in the binary format read by loadCompiled.
+    bool saveCompiled(const std::string& filename);
+
+    // Add a theme from a static table of styles, such as a fixed theme built
+    // into your plugin. Nothing is parsed: the styles are copied as they are.
+    //
+    // ```cpp
+    // using namespace svg_theme;
+    // static const StyleEntry dark[] = {
+    //     { "panel", Style("#202020"_hex) },
+    //     { "logo-text", Style(Paint::none(), "#e0e0e0"_hex).withStrokeWidth(0.5f) },
+    // };
+    // themes.addTheme("Dark", dark);
+    // ```
+    //
+    // An existing theme with the same name is replaced.
+    bool addTheme(const std::string& name, const StyleEntry * styles, size_t count);
+    template <size_t N>
+    bool addTheme(const std::string& name, const StyleEntry (&styles)[N]) {
+        return addTheme(name, styles, N);
+    }
+
     // true if any themes are available after calling load.
     bool isLoaded() { return !themes.empty(); }
 
-    // Get a theme by name
+    // Reload the theme files if any of them has changed since it was loaded,
+    // for editing themes while Rack is running.
+    // Files are checked by modification time and size, at most once per
+    // reload interval, so reload() is cheap enough to call every frame.
+    // A changed file is parsed in full before anything is replaced; if it
+    // fails to parse, the current themes are kept and the error is logged.
+    // Reloaded themes are updated in place, so a shared_ptr<Theme> you hold
+    // gets the new styles, and they are re-applied to every ThemedImage
+    // currently showing one of them.
+    // Returns true if the themes were replaced. Themed widgets must then be
+    // themed again (for example with ApplyChildrenTheme), both to redraw and
+    // to replace their cached themed SVGs.
+    bool reload();
+    // Minimum time between file checks in reload(). The default is 0.25 seconds.
+    void setReloadInterval(double seconds) {
+        reload_interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    }
+    // Incremented each time reload() replaces the themes.
+    // When several widgets share an SvgThemes, only the caller of reload()
+    // sees it return true, so the others can compare versions instead.
+    unsigned int getVersion() const { return version; }
+
+    // Get a theme by name.
+    // In lazy mode, the theme is parsed on first request.
     std::shared_ptr<Theme> getTheme(const std::string& name);
+    // Get a theme by name, but only if it's parsed: this never parses.
+    // In lazy mode, returns nullptr for themes getTheme hasn't asked for yet.
+    std::shared_ptr<Theme> getParsedTheme(const std::string& name);
 
-    // Apply the theme to an NSVGImage*
-    // This uses Rack's builtin SVG cache, indexed by SVG filename. Multiple instances using the same SVG file will have the theme applied (but not display it until they have some other reason to redraw).
-    // return true if the SVG was modified. 
+    // Apply the theme to an NSVGImage*, in place. Every user of the image
+    // sees the change, once they have some other reason to redraw.
+    // Nothing is kept: each call walks all the shapes and looks up each tag,
+    // which is right for a one-off. To apply themes to an image repeatedly,
+    // use a ThemedImage, which keeps a plan of just the themed shapes.
+    // return true if the SVG was modified.
     // You must send a Dirty event to any widget where applyTheme to any of its component SVGs returns true.
     bool applyTheme(std::shared_ptr<Theme> theme, NSVGimage* svg);
-    // Apply the theme to an SVG
-    // This uses an alternative SVG cache, indexed by SVG filename and theme, allowing multiple instances of the same module to be independent.
+    // Apply the theme to the image of a ThemedImage.
+    // The theme is bound to the image on first use and the plan kept in the
+    // ThemedImage, so applying it again is cheap.
     // return true if the SVG was modified.
-    // Use the SVG as is required for your situation.
-    bool applyTheme(std::shared_ptr<Theme> theme, std::string svgFile, std::shared_ptr<rack::window::Svg>& svg);
+    bool applyTheme(std::shared_ptr<Theme> theme, ThemedImage& image);
+    // Wait until all background work using this SvgThemes is done, such as
+    // prewarming and preview rendering (see PrewarmThemedSvgs and
+    // RequestThemePreviews in svt_rack.hpp): the work of its extension.
+    // Loading and reloading wait for it first.
+    void waitPrewarm();
+
+    // The extension of this SvgThemes, or nullptr if none is set.
+    ThemeExtension* getExtension() const { return extension.load(std::memory_order_acquire); }
+    // Set the extension, unless one is set already, and return the one in
+    // use. The SvgThemes owns it from then on, and waits for it before it's
+    // destroyed. Safe on any thread.
+    ThemeExtension* setExtension(std::unique_ptr<ThemeExtension> extension);
+
+    // Bind the theme to an NSVGimage, resolving each tagged shape to its style.
+    // applyTheme(theme, ThemedImage&) binds on first use and keeps the plan,
+    // so you only need this to manage plans yourself.
+    // Safe on worker threads, even while themes are parsed lazily.
+    std::shared_ptr<ApplyPlan> bindTheme(std::shared_ptr<Theme> theme, NSVGimage* svg);
+    // Apply a bound theme. Return true if the SVG was modified.
+    // With `gradients`, the arena for the image, the theme can turn colors
+    // into gradients and back. Without it, such changes are skipped with a
+    // warning, as they would leak memory.
+    bool applyPlan(const ApplyPlan& plan, GradientArena* gradients = nullptr);
+
+    // Get the tags whose styles differ between two themes.
+    // Deltas are computed on first request and cached.
+    std::shared_ptr<ThemeDelta> getThemeDelta(std::shared_ptr<Theme> from, std::shared_ptr<Theme> to);
+    // Switch an image that currently has the `from` theme applied to the
+    // `to` theme, touching only the shapes whose style differs.
+    // The result is the same as applyTheme(to, svg), but the cost is
+    // proportional to the difference between the themes.
+    // Falls back to applyTheme(to, image) when `from` is null or the themes
+    // were not loaded by this SvgThemes.
+    // return true if the SVG was modified.
+    bool applyThemeDelta(std::shared_ptr<Theme> from, std::shared_ptr<Theme> to, ThemedImage& image);
+    // Put back the attributes of an image as they were before it was first
+    // themed through its ThemedImage, without reloading the SVG. The
+    // defaults are captured in the ThemedImage on that first apply, and
+    // restoring them is a single pass over the themable shapes.
+    // Use applyTheme rather than applyThemeDelta to theme the image again.
+    // return true if the SVG was modified.
+    bool restoreDefault(ThemedImage& image);
 
     // Get a list of themes defined in the style sheet
     std::vector<std::string> getThemeNames()
@@ -185,23 +822,90 @@ public:
         return result;
     }
 
+    // What theming has cost so far: counts and times of loading, binding and
+    // applying themes, from any thread, with those of the extension.
+    // Counted only when the implementation (the file defining
+    // IMPLEMENT_SVG_THEME) also defines SVG_THEME_STATS. Otherwise the
+    // counting compiles to nothing, and the stats stay zero.
+    ThemeStats getStats() const;
+    void resetStats();
+
 private:
+    friend class ThemedImage;
+
+    // Where an unparsed theme is defined, in lazy mode.
+    struct ThemeSource {
+        std::shared_ptr<const std::string> text;
+        size_t begin;
+        size_t end;
+        int line;
+        int column;
+        std::string base; // the theme it extends, if any
+    };
+    // Shared styles defined in a file's "styles" blocks, by name.
+    typedef std::unordered_map<std::string, const Style*> NamedStyles;
 
-    static void LogNothing(Severity severity, ErrorCode code, std::string info) {}
+    // A loaded theme file, and how to load it again.
+    enum class Loader { Json, Streaming, Compiled };
+    struct ThemeFile {
+        std::string filename;
+        Loader loader;
+        FileStamp stamp;
+    };
 
     std::vector<std::shared_ptr<Theme>> themes;
-    LogCallback log = LogNothing;
+    bool lazy = false;
+    std::vector<ThemeFile> files;
+    std::chrono::steady_clock::duration reload_interval = std::chrono::milliseconds(250);
+    std::chrono::steady_clock::time_point next_reload_check;
+    unsigned int version = 0;
+    std::unordered_map<const Theme*, ThemeSource> unparsed;
+    std::shared_ptr<TagTable> tags = std::make_shared<TagTable>();
+    std::shared_ptr<StylePool> pool = std::make_shared<StylePool>();
+    // Named styles of each loaded file, kept for parsing lazy themes.
+    std::unordered_map<std::string, NamedStyles> named_styles;
+    std::map<std::pair<const Theme*, const Theme*>, std::shared_ptr<ThemeDelta>> deltas;
+    // The ThemedImages themed by this SvgThemes, which re-applies them on reload.
+    std::unordered_set<ThemedImage*> themed_images;
+    // Held while lazy parsing adds tags and styles, and while binding themes.
+    std::mutex tags_mutex;
+    // Owned; see setExtension.
+    std::atomic<ThemeExtension*> extension{nullptr};
+    LogCallback log;
+    Severity log_level = Severity::Info;
+
+    // The counters behind getStats, allocated only when the implementation
+    // defines SVG_THEME_STATS.
+    struct StatCounters;
+    std::unique_ptr<StatCounters> counters;
 
-    void logInfo(std::string info) {
-        log(Severity::Info, ErrorCode::NoError, info);
+    // Messages are formatted only when they pass the severity threshold.
+    template <typename... Args>
+    void logMessage(Severity severity, ErrorCode code, const char * fmt, Args... args) {
+        if (isLogging(severity)) {
+            log(severity, code, format_string(fmt, args...));
+        }
+    }
+    template <typename... Args>
+    void logInfo(const char * fmt, Args... args) {
+        logMessage(Severity::Info, ErrorCode::NoError, fmt, args...);
     }
-    void logError(ErrorCode code, std::string info) {
-        log(Severity::Error, code, info);
+    template <typename... Args>
+    void logError(ErrorCode code, const char * fmt, Args... args) {
+        logMessage(Severity::Error, code, fmt, args...);
     }
-    void logWarning(ErrorCode code, std::string info) {
-        log(Severity::Warn, code, info);
+    template <typename... Args>
+    void logWarning(ErrorCode code, const char * fmt, Args... args) {
+        logMessage(Severity::Warn, code, fmt, args...);
     }
-    bool requireValidHexColor(std::string hex, const char * name);
+    // A warning about a shape, prefixed with the shape's tag.
+    template <typename... Args>
+    void logShapeWarning(ErrorCode code, const NSVGshape* shape, const char * fmt, Args... args) {
+        if (isLogging(Severity::Warn)) {
+            log(Severity::Warn, code, "'" + GetTagView(shape).str() + "': " + format_string(fmt, args...));
+        }
+    }
+    bool requireHexColor(const char * hex, const char * name, PackedColor& color);
     bool requireArray(json_t* j, const char * name);
     bool requireObject(json_t* j, const char * name);
     bool requireObjectOrString(json_t* j, const char * name);
@@ -209,17 +913,86 @@ private:
     bool requireNumber(json_t* j, const char * name);
     bool requireInteger(json_t* j, const char * name);
 
-    bool parseFill(json_t* root, std::shared_ptr<Style>);
-    bool parseStroke(json_t* root, std::shared_ptr<Style>);
-    bool parseOpacity(json_t* root, std::shared_ptr<Style>);
-    bool parseStyle(const char * name, json_t* root, std::shared_ptr<Theme> theme);
-    bool parseTheme(json_t* root, std::shared_ptr<Theme> theme);
+    bool parseFill(json_t* root, Style& style);
+    bool parseStroke(json_t* root, Style& style);
+    bool parseOpacity(json_t* root, Style& style);
+    bool parseStyle(const char * name, json_t* root, Style& style);
+    bool parseTheme(json_t* root, std::shared_ptr<Theme> theme, const NamedStyles& named);
+    bool parseNamedStyles(json_t* root, NamedStyles& named);
     bool parseGradient(json_t* root, Gradient& gradient);
 
-    bool applyPaint(std::string tag, NSVGpaint & target, Paint& source);
-    bool applyStroke(std::string tag, NSVGshape* shape, std::shared_ptr<Style> style);
-    bool applyFill(std::string tag, NSVGshape* shape, std::shared_ptr<Style> style);
+    template <typename... Args>
+    void logStreamError(ErrorCode code, const JsonReader& reader, const char * fmt, Args... args);
+    bool streamThemes(JsonReader& reader, const std::string& filename, std::vector<std::shared_ptr<Theme>>& loaded, NamedStyles& named);
+    bool streamTheme(JsonReader& reader, std::shared_ptr<Theme> theme, const NamedStyles& named);
+    bool streamStyle(JsonReader& reader, const std::string& name, Style& style);
+    bool streamNamedStyles(JsonReader& reader, NamedStyles& named);
+    bool streamPaint(JsonReader& reader, const char * name, Paint& paint, Style& style);
+    bool streamGradient(JsonReader& reader, Gradient& gradient);
+    bool streamColor(JsonReader& reader, const char * name, PackedColor& color);
+    bool requireStreamColor(const JsonReader& reader, const char * name, PackedColor& color);
+    bool streamNumber(JsonReader& reader, const char * name, float& value);
+    bool loadLazy(const std::string& filename);
+    std::shared_ptr<Theme> makeTheme(const std::string& name, const std::string& filename);
+    // Inherit from `base`, which must be one of the themes in [begin, end).
+    bool extendTheme(Theme& theme, const std::string& base,
+        std::vector<std::shared_ptr<Theme>>::const_iterator begin,
+        std::vector<std::shared_ptr<Theme>>::const_iterator end);
+    bool useNamedStyle(Theme& theme, const std::string& tag, const std::string& style_name, const NamedStyles& named);
+    void trackFile(const std::string& filename, Loader loader);
+    void reapplyReloaded(const std::vector<std::shared_ptr<Theme>>& updated);
+    bool parseDeferred(std::shared_ptr<Theme> theme);
+    // Find a loaded theme by name, parsed or not.
+    std::shared_ptr<Theme> findTheme(const std::string& name);
+    void parseAllDeferred();
+
+    bool applyPaint(const NSVGshape* shape, NSVGpaint & target, size_t slot, const Paint& source, GradientArena* gradients);
+    bool applyStroke(NSVGshape* shape, int index, const Style& style, GradientArena* gradients);
+    bool applyFill(NSVGshape* shape, int index, const Style& style, GradientArena* gradients);
+    // Apply a style to a shape, at `index` among the image's shapes.
+    // Returns the number of attributes changed.
+    int applyStyle(NSVGshape* shape, int index, const Style& style, GradientArena* gradients);
+    // Get the image's full plan for the theme, binding if necessary.
+    std::shared_ptr<ApplyPlan> cachedPlan(std::shared_ptr<Theme> theme, ThemedImage& image);
+    // Start keeping the image, if this SvgThemes isn't already.
+    void track(ThemedImage& image);
+    // Stop keeping the image.
+    void release(ThemedImage& image);
+    // Capture the defaults of the image, if not yet captured.
+    void captureDefaults(ThemedImage& image);
+
+};
+
+// Process-wide registry of loaded theme files, so that all the modules using
+// a themes file share one SvgThemes instead of each loading its own.
+// The SvgThemes is released when the last holder lets go of it.
+class ThemeRegistry
+{
+public:
+    // Get the shared SvgThemes for a themes file, loading it on first use.
+    // `init` is called on a new SvgThemes before loading, for example to set
+    // the log callback or lazy mode. Only the caller that loads the file
+    // runs its `init`: the others get the SvgThemes as that caller set it
+    // up, and their `init` is not called. Pass the same `init` for a file
+    // everywhere you acquire it.
+    // The file is loaded outside the registry's lock, so acquiring one file
+    // never waits for another to load. Callers for a file that is being
+    // loaded wait for that load.
+    // Returns nullptr if the file cannot be loaded. The failure is kept
+    // until the file changes, so a broken file is not read again on every
+    // call.
+    static std::shared_ptr<SvgThemes> acquire(const std::string& filename, std::function<void(SvgThemes&)> init = nullptr);
 
+private:
+    struct Entry {
+        std::weak_ptr<SvgThemes> themes;
+        bool loading = false;
+        bool failed = false;
+        FileStamp stamp; // of the file when it failed to load
+    };
+    static std::mutex mutex;
+    static std::condition_variable load_done;
+    static std::unordered_map<std::string, Entry> files;
 };
 
 // Widgets that support theming should implement IApplyTheme.
@@ -243,7 +1016,7 @@ private:
 //     // implement IApplyTheme
 //     bool applyTheme(svg_theme::SvgThemes& themes, std::shared_ptr<svg_theme::Theme> theme) override
 //     {
-//         return themes.applyTheme(theme, sw->svg->handle);
+//         return svg_theme::ApplyThemeToSvg(themes, theme, asset::plugin(pluginInstance, "res/Screw.svg"), sw->svg);
 //     }
 // };
 // ```
@@ -277,219 +1050,864 @@ const char * SeverityName(Severity sev) {
     return "[unknown]";
 }
 
-std::string GetTag(NSVGshape* shape)
+// The view points into the shape's id buffer, so no allocation is done.
+TagView GetTagView(const NSVGshape* shape)
 {
-    if (!shape) return "";
-    if (!shape->id[0]) return "";
-    auto id = std::string(shape->id);
-    auto dashes = id.rfind("--");
-    if (dashes != std::string::npos) {
-        id = id.substr(dashes + 2);
+    if (!shape) return TagView();
+    const char * id = shape->id;
+    const char * start = id;
+    const char * p = id;
+    for (; *p; ++p) {
+        if (p[0] == '-' && p[1] == '-') {
+            start = p + 2;
+        }
     }
-    return id;
+    return TagView(start, p - start);
 }
 
-inline int hex_value(unsigned char ch) {
-    if (ch > 'f' || ch < '0') { return -1; }
-    if (ch <= '9') { return ch & 0xF; }
-    if (ch < 'A') { return -1; }
-    if (ch < 'G') { return 10 + ch - 'A'; }
-    if (ch < 'a') { return -1; }
-    return 10 + ch - 'a';
-}
-
-inline PackedColor PackRGB(unsigned int r, unsigned int g, unsigned int b) {
-    return r | (g << 8) | (b << 16) | (255 << 24);
-}
-inline PackedColor PackRGBA(unsigned int r, unsigned int g, unsigned int b, unsigned int a) {
-    return r | (g << 8) | (b << 16) | (a << 24);
+std::string GetTag(const NSVGshape* shape)
+{
+    return GetTagView(shape).str();
 }
 
-bool isValidHexColor(std::string hex) {
-    switch (hex.size()) {
-        case 1 + 3: 
-        case 1 + 4:
-        case 1 + 6: 
-        case 1 + 8: break;
-        default: return false;
+inline unsigned int HashTag(TagView tag)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (size_t n = 0; n < tag.length; ++n) {
+        hash ^= static_cast<unsigned char>(tag.text[n]);
+        hash *= 16777619u;
     }
-    if (*hex.begin() != '#') return false;
-    return std::string::npos == hex.find_first_not_of("0123456789ABCDEFabcdef", 1);
+    return hash;
 }
 
-std::vector<unsigned char> ParseHex(std::string hex) {
-    std::vector<unsigned char> result;
-
-    // Color representations:
-    //  short: #rgb, #rgba
-    //  long: #rrggbb, #rrggbbaa
-    bool long_hex = true;
-    switch (hex.size()) {
-        case 1 + 3: 
-        case 1 + 4: long_hex = false; break;
-        case 1 + 6: 
-        case 1 + 8: long_hex = true; break;
-        default: return result;
+int HashIndex::add(unsigned int hash)
+{
+    // keep the load factor at or below one half
+    if ((hashes.size() + 1) * 2 > slots.size()) {
+        rehash(slots.empty() ? 64 : slots.size() * 2);
     }
-
-    enum State { Hex = -1, R1, R2, G1, G2, B1, B2, A1, A2, End };
-    int state = State::Hex;
-    int value = 0;
-    for (unsigned char ch: hex) {
-        if (state == State::Hex) {
-            if (ch == '#') {
-                ++state;
-            } else {
-                return result;
-            }
-        } else {
-            auto nibble = hex_value(ch);
-            if (-1 == nibble) {
-                result.clear();
-                return result;
-            }
-            if (state & 1) { // odd
-                value |= nibble;
-                result.push_back(value);
-                value = 0;
-                ++state;
-            } else { // even
-                value = nibble << 4;
-                if (long_hex) {
-                    ++state;
-                } else {
-                    result.push_back(value);
-                    value = 0;
-                    state += 2;
-                }
-            }
-        }
-        if (state >= State::End) {
-            break;
-        }
+    int id = static_cast<int>(hashes.size());
+    hashes.push_back(hash);
+    size_t mask = slots.size() - 1;
+    size_t slot = hash & mask;
+    while (slots[slot] >= 0) {
+        slot = (slot + 1) & mask;
     }
-    return result;
+    slots[slot] = id;
+    return id;
 }
 
-std::string format_string(const char *fmt, ...)
+void HashIndex::reserve(size_t count)
 {
-    const int len = 256;
-    std::string s(len, '\0');
-    va_list args;
-    va_start(args, fmt);
-    auto r = std::vsnprintf(&(*s.begin()), len + 1, fmt, args);
-    return r < 0 ? "??" : s;
+    hashes.reserve(count);
+    size_t capacity = slots.empty() ? 64 : slots.size();
+    while (count * 2 > capacity) capacity *= 2;
+    if (capacity != slots.size()) rehash(capacity);
 }
 
-const PackedColor OPAQUE_BLACK = 255 << 24;
+void HashIndex::rehash(size_t capacity)
+{
+    slots.assign(capacity, -1);
+    size_t mask = slots.size() - 1;
+    for (size_t id = 0; id < hashes.size(); ++id) {
+        size_t slot = hashes[id] & mask;
+        while (slots[slot] >= 0) {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = static_cast<int>(id);
+    }
+}
 
-std::shared_ptr<Theme> SvgThemes::getTheme(const std::string& name)
+int TagTable::find(TagView tag, unsigned int hash) const
 {
-    auto r = std::find_if(themes.begin(), themes.end(), [=](const std::shared_ptr<Theme> theme) {
-        return 0 == theme->name.compare(name);
+    return index.find(hash, [&](int id) {
+        const std::string& candidate = names[id];
+        return candidate.size() == tag.length && 0 == memcmp(candidate.data(), tag.text, tag.length);
     });
-    return r == themes.end() ? nullptr : *r;
 }
 
-bool SvgThemes::requireValidHexColor(std::string hex, const char * name)
+int TagTable::find(TagView tag) const
 {
-    if (isValidHexColor(hex)) return true;
-    logError(ErrorCode::InvalidHexColor, format_string("'%s': invalid hex color: '%s'", name, hex.c_str()));
-    return false;
+    return find(tag, HashTag(tag));
 }
-bool SvgThemes::requireArray(json_t* j, const char * name)
+
+int TagTable::intern(TagView tag)
 {
-    if (json_is_array(j)) return true;
-    logError(ErrorCode::ArrayExpected, format_string("'%s': array expected", name));
-    return false;
+    unsigned int hash = HashTag(tag);
+    int id = find(tag, hash);
+    if (id >= 0) return id;
+    names.push_back(tag.str());
+    return index.add(hash);
 }
-bool SvgThemes::requireObject(json_t* j, const char * name)
+
+// Hash the values that Style::operator== compares, so equal styles hash equally.
+static unsigned int HashStyle(const Style& style)
 {
-    if (json_is_object(j)) return true;
-    logError(ErrorCode::ObjectExpected, format_string("'%s': object expected", name));
-    return false;
+    unsigned int hash = 2166136261u;
+    auto mix = [&hash](uint32_t value) {
+        hash ^= value;
+        hash *= 16777619u;
+    };
+    auto mix_float = [&mix](float value) {
+        uint32_t bits = 0;
+        if (value != 0.f) memcpy(&bits, &value, sizeof(bits)); // -0 == 0
+        mix(bits);
+    };
+    const Paint* paints[] = { &style.fill, &style.stroke };
+    for (const Paint* paint : paints) {
+        mix(static_cast<uint32_t>(paint->Kind()));
+        mix(paint->getColor());
+        const Gradient* gradient = paint->getGradient();
+        if (gradient) {
+            mix(gradient->nstops);
+            for (int n = 0; n < gradient->nstops; ++n) {
+                mix(static_cast<uint32_t>(gradient->stops[n].index));
+                mix_float(gradient->stops[n].offset);
+                mix(gradient->stops[n].color);
+            }
+        }
+    }
+    mix(style.isApplyOpacity());
+    if (style.isApplyOpacity()) mix_float(style.opacity);
+    mix(style.isApplyStrokeWidth());
+    if (style.isApplyStrokeWidth()) mix_float(style.stroke_width);
+    // Mixing whole words leaves the low bits, which pick the slot, depending
+    // only on the low bits of each value, so finish with an avalanche.
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
 }
-bool SvgThemes::requireObjectOrString(json_t* j, const char * name)
+
+const Style* StylePool::intern(const Style& style)
 {
-    if (json_is_object(j) || json_is_string(j)) return true;
-    logError(ErrorCode::ObjectOrStringExpected, format_string("'%s': Object or string expected", name));
-    return false;
+    unsigned int hash = HashStyle(style);
+    int id = index.find(hash, [&](int id) { return *styles[id] == style; });
+    if (id >= 0) return styles[id];
+
+    if (0 == available) {
+        available = std::max(size_t(16), styles.size());
+        chunks.emplace_back(new Style[available]);
+        next = chunks.back().get();
+    }
+    Style* pooled = next++;
+    --available;
+    *pooled = style;
+    styles.push_back(pooled);
+    index.add(hash);
+    return pooled;
 }
-bool SvgThemes::requireString(json_t* j, const char * name)
+
+void StylePool::reserve(size_t count)
 {
-    if (json_is_string(j)) return true;
-    logError(ErrorCode::StringExpected, format_string("'%s': String expected", name));
-    return false;
+    size_t total = styles.size() + count;
+    styles.reserve(total);
+    index.reserve(total);
+    if (available < count) {
+        available = std::max(size_t(16), count);
+        chunks.emplace_back(new Style[available]);
+        next = chunks.back().get();
+    }
 }
-bool SvgThemes::requireNumber(json_t* j, const char * name)
-{
-    if (json_is_number(j)) return true;
-    logError(ErrorCode::NumberExpected, format_string("'%s': Number expected", name));
-    return false;
+
+const PackedColor OPAQUE_BLACK = 255 << 24;
+
+// Pack the nibbles of a hex color with `digits` digits.
+// Short colors (#rgb, #rgba) use each digit as the high nibble of the component.
+static PackedColor PackHexNibbles(const unsigned char * n, size_t digits) {
+    switch (digits) {
+        case 3: return PackRGB(n[0] << 4, n[1] << 4, n[2] << 4);
+        case 4: return PackRGBA(n[0] << 4, n[1] << 4, n[2] << 4, n[3] << 4);
+        case 6: return PackRGB((n[0] << 4) | n[1], (n[2] << 4) | n[3], (n[4] << 4) | n[5]);
+        default: return PackRGBA((n[0] << 4) | n[1], (n[2] << 4) | n[3], (n[4] << 4) | n[5], (n[6] << 4) | n[7]);
+    }
 }
-bool SvgThemes::requireInteger(json_t* j, const char * name)
+
+static bool IsHexColorLength(size_t length) {
+    switch (length) {
+        case 1 + 3:
+        case 1 + 4:
+        case 1 + 6:
+        case 1 + 8: return true;
+        default: return false;
+    }
+}
+
+bool ParseHexColor(const char * text, size_t length, PackedColor& color)
 {
-    if (json_is_integer(j)) return true;
-    logError(ErrorCode::IntegerExpected, format_string("'%s': Integer expected", name));
-    return false;
+    if (!text || !IsHexColorLength(length) || text[0] != '#') return false;
+    size_t digits = length - 1;
+    unsigned char n[8];
+    for (size_t i = 0; i < digits; ++i) {
+        int nibble = hex_value(static_cast<unsigned char>(text[1 + i]));
+        if (nibble < 0) return false;
+        n[i] = static_cast<unsigned char>(nibble);
+    }
+    color = PackHexNibbles(n, digits);
+    return true;
 }
 
-PackedColor parseColor(const char * text)
+size_t ParseHexColors(const char * const * texts, const size_t * lengths, size_t count, PackedColor * colors, bool * valid)
 {
-    auto parts = ParseHex(text);
-    if (parts.size() == 3) {
-        return PackRGB(parts[0], parts[1], parts[2]);
+    size_t valid_count = 0;
+    size_t i = 0;
+#ifdef SVG_THEME_SSE2
+    // Classify and convert the digits of two colors at once, each in one
+    // half of a 16-byte slot.
+    for (; i + 2 <= count; i += 2) {
+        alignas(16) unsigned char n[16] = {};
+        int wanted[2] = { -1, -1 };
+        for (size_t k = 0; k < 2; ++k) {
+            const char * text = texts[i + k];
+            size_t length = lengths[i + k];
+            if (text && IsHexColorLength(length) && text[0] == '#') {
+                std::memcpy(n + 8 * k, text + 1, length - 1);
+                wanted[k] = ((1 << (length - 1)) - 1) << (8 * k);
+            }
+        }
+        __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(n));
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i is_digit = _mm_and_si128(
+            _mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+            _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+        __m128i is_alpha = _mm_and_si128(
+            _mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+            _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+        int mask = _mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha));
+        __m128i nibbles = _mm_or_si128(
+            _mm_and_si128(is_digit, _mm_sub_epi8(v, _mm_set1_epi8('0'))),
+            _mm_and_si128(is_alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+        _mm_store_si128(reinterpret_cast<__m128i*>(n), nibbles);
+        for (size_t k = 0; k < 2; ++k) {
+            bool ok = wanted[k] >= 0 && (mask & wanted[k]) == wanted[k];
+            colors[i + k] = ok ? PackHexNibbles(n + 8 * k, lengths[i + k] - 1) : OPAQUE_BLACK;
+            if (valid) valid[i + k] = ok;
+            valid_count += ok;
+        }
     }
-    if (parts.size() == 4) {
-        return PackRGBA(parts[0], parts[1], parts[2], parts[3]);
+#endif
+    for (; i < count; ++i) {
+        colors[i] = OPAQUE_BLACK;
+        bool ok = ParseHexColor(texts[i], lengths[i], colors[i]);
+        if (valid) valid[i] = ok;
+        valid_count += ok;
     }
-    // user error coding the color
-    return OPAQUE_BLACK;
+    return valid_count;
 }
 
-float getNumber(json_t * j)
+std::string format_string(const char *fmt, ...)
 {
-    if (json_is_real(j)) return json_real_value(j);
-    if (json_is_number(j)) return json_number_value(j);
-    if (json_is_integer(j)) return static_cast<float>(json_integer_value(j));
-    return 1.f;
+    char buffer[256];
+    va_list args;
+    va_start(args, fmt);
+    auto r = std::vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    if (r < 0) return "??";
+    if (static_cast<size_t>(r) < sizeof(buffer)) return std::string(buffer, r);
+
+    std::string s(r, '\0');
+    va_start(args, fmt);
+    std::vsnprintf(&(*s.begin()), r + 1, fmt, args);
+    va_end(args);
+    return s;
 }
 
-bool SvgThemes::parseOpacity(json_t * root, std::shared_ptr<Style> style)
+inline bool IsGradient(const NSVGpaint& paint)
 {
-    auto oopacity = json_object_get(root, "opacity");
-    if (oopacity) {
-        if (!requireNumber(oopacity, "opacity")) return false;
-        style->setOpacity(std::max(0.f, std::min(1.f, getNumber(oopacity))));
+    return (paint.type == NSVG_PAINT_LINEAR_GRADIENT) || (paint.type == NSVG_PAINT_RADIAL_GRADIENT);
+}
+
+// The size nanosvg allocates for a gradient.
+inline size_t GradientBytes(const NSVGgradient* gradient)
+{
+    return sizeof(NSVGgradient) + sizeof(NSVGgradientStop) * (gradient->nstops - 1);
+}
+
+static bool CloneGradient(NSVGpaint& paint)
+{
+    if (!IsGradient(paint) || !paint.gradient) return true;
+    const NSVGgradient* source = paint.gradient;
+    size_t size = GradientBytes(source);
+    auto copy = static_cast<NSVGgradient*>(malloc(size));
+    if (!copy) {
+        // leave the paint safe to delete
+        paint.type = NSVG_PAINT_NONE;
+        return false;
     }
+    memcpy(copy, source, size);
+    paint.gradient = copy;
     return true;
 }
 
-bool SvgThemes::parseGradient(json_t* ogradient, Gradient& gradient)
+NSVGimage* CloneImage(const NSVGimage* source)
 {
-    bool ok = true;
-    gradient.nstops = 0;
-    if (ogradient) {
-        if (!requireArray(ogradient, "gradient")) return false;
+    if (!source) return nullptr;
+    auto image = static_cast<NSVGimage*>(malloc(sizeof(NSVGimage)));
+    if (!image) return nullptr;
+    memcpy(image, source, sizeof(NSVGimage));
+    image->shapes = nullptr;
 
-        int index;
-        PackedColor color;
-        float offset;
+    // The copy is linked in as it is built, so that a partial copy is
+    // always in a state that nsvgDelete can free.
+    NSVGshape** shape_tail = &image->shapes;
+    for (const NSVGshape* shape = source->shapes; shape; shape = shape->next) {
+        auto copy = static_cast<NSVGshape*>(malloc(sizeof(NSVGshape)));
+        if (!copy) {
+            nsvgDelete(image);
+            return nullptr;
+        }
+        memcpy(copy, shape, sizeof(NSVGshape));
+        copy->paths = nullptr;
+        copy->next = nullptr;
+        *shape_tail = copy;
+        shape_tail = &copy->next;
 
-        json_t * item; size_t n;
-        json_array_foreach(ogradient, n, item) {
-            if (n > 1) {
-                logError(ErrorCode::TwoGradientStopsMax, "A maximum of two gradient stops is allowed");
-                return false;
+        bool ok = CloneGradient(copy->fill);
+        ok = CloneGradient(copy->stroke) && ok;
+
+        NSVGpath** path_tail = &copy->paths;
+        for (const NSVGpath* path = shape->paths; ok && path; path = path->next) {
+            auto path_copy = static_cast<NSVGpath*>(malloc(sizeof(NSVGpath)));
+            if (!path_copy) {
+                ok = false;
+                break;
             }
-            auto oindex = json_object_get(item, "index");
-            if (oindex) {
-                if (requireInteger(oindex, "index")) {
-                    index = json_integer_value(oindex);
-                    if (!(0 == index || 1 == index)) {
-                        logError(ErrorCode::GradientStopIndexZeroOrOne, "Gradient stop index must be 0 or 1");
-                        ok = false;
-                    } 
+            memcpy(path_copy, path, sizeof(NSVGpath));
+            path_copy->next = nullptr;
+            path_copy->pts = static_cast<float*>(malloc(path->npts * 2 * sizeof(float)));
+            *path_tail = path_copy;
+            path_tail = &path_copy->next;
+            if (!path_copy->pts) {
+                ok = false;
+                break;
+            }
+            memcpy(path_copy->pts, path->pts, path->npts * 2 * sizeof(float));
+        }
+        if (!ok) {
+            nsvgDelete(image);
+            return nullptr;
+        }
+    }
+    return image;
+}
+
+// Blocks within a variant are aligned for any type.
+static size_t AlignVariantBlock(size_t size)
+{
+    const size_t alignment = alignof(std::max_align_t);
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+NSVGimage* CloneImageVariant(const NSVGimage* source)
+{
+    if (!source) return nullptr;
+
+    // One allocation: the image, then each shape followed by its gradients.
+    size_t size = AlignVariantBlock(sizeof(NSVGimage));
+    for (const NSVGshape* shape = source->shapes; shape; shape = shape->next) {
+        size += AlignVariantBlock(sizeof(NSVGshape));
+        const NSVGpaint* paints[] = { &shape->fill, &shape->stroke };
+        for (const NSVGpaint* paint : paints) {
+            if (IsGradient(*paint) && paint->gradient) {
+                size += AlignVariantBlock(GradientBytes(paint->gradient));
+            }
+        }
+    }
+    auto block = static_cast<char*>(malloc(size));
+    if (!block) return nullptr;
+
+    auto image = reinterpret_cast<NSVGimage*>(block);
+    memcpy(image, source, sizeof(NSVGimage));
+    char* next = block + AlignVariantBlock(sizeof(NSVGimage));
+    NSVGshape** shape_tail = &image->shapes;
+    for (const NSVGshape* shape = source->shapes; shape; shape = shape->next) {
+        auto copy = reinterpret_cast<NSVGshape*>(next);
+        next += AlignVariantBlock(sizeof(NSVGshape));
+        // The copy keeps pointing at the source's paths.
+        memcpy(copy, shape, sizeof(NSVGshape));
+        NSVGpaint* paints[] = { &copy->fill, &copy->stroke };
+        for (NSVGpaint* paint : paints) {
+            if (IsGradient(*paint) && paint->gradient) {
+                size_t gradient_size = GradientBytes(paint->gradient);
+                memcpy(next, paint->gradient, gradient_size);
+                paint->gradient = reinterpret_cast<NSVGgradient*>(next);
+                next += AlignVariantBlock(gradient_size);
+            }
+        }
+        *shape_tail = copy;
+        shape_tail = &copy->next;
+    }
+    *shape_tail = nullptr;
+    return image;
+}
+
+void DeleteImageVariant(NSVGimage* variant)
+{
+    free(variant);
+}
+
+size_t ImageBytes(const NSVGimage* svg, const NSVGimage* master)
+{
+    if (!svg) return 0;
+    size_t bytes = sizeof(NSVGimage);
+    const NSVGshape* master_shape = master ? master->shapes : nullptr;
+    for (const NSVGshape* shape = svg->shapes; shape; shape = shape->next) {
+        bytes += sizeof(NSVGshape);
+        if (!master_shape || shape->paths != master_shape->paths) {
+            for (const NSVGpath* path = shape->paths; path; path = path->next) {
+                bytes += sizeof(NSVGpath) + path->npts * 2 * sizeof(float);
+            }
+        }
+        const NSVGpaint* paints[] = { &shape->fill, &shape->stroke };
+        for (const NSVGpaint* paint : paints) {
+            if (IsGradient(*paint) && paint->gradient) {
+                bytes += GradientBytes(paint->gradient);
+            }
+        }
+        if (master_shape) master_shape = master_shape->next;
+    }
+    return bytes;
+}
+
+bool Gradient::setStop(const GradientStop& stop)
+{
+    if (stop.index < 0 || stop.index >= MAX_GRADIENT_STOPS) return false;
+    int n = 0;
+    while (n < nstops && stops[n].index < stop.index) ++n;
+    if (n == nstops || stops[n].index != stop.index) {
+        // There's room: there are fewer stops than indexes.
+        for (int m = nstops; m > n; --m) {
+            stops[m] = stops[m - 1];
+        }
+        ++nstops;
+    }
+    stops[n] = stop;
+    return true;
+}
+
+// Invert a nanosvg transform, as nanosvg does.
+static void InvertTransform(float* inverse, const float* t)
+{
+    double det = (double)t[0] * t[3] - (double)t[2] * t[1];
+    if (det > -1e-6 && det < 1e-6) {
+        const float identity[6] = { 1.f, 0.f, 0.f, 1.f, 0.f, 0.f };
+        memcpy(inverse, identity, sizeof(identity));
+        return;
+    }
+    double invdet = 1.0 / det;
+    inverse[0] = (float)(t[3] * invdet);
+    inverse[2] = (float)(-t[2] * invdet);
+    inverse[4] = (float)(((double)t[2] * t[5] - (double)t[3] * t[4]) * invdet);
+    inverse[1] = (float)(-t[1] * invdet);
+    inverse[3] = (float)(t[0] * invdet);
+    inverse[5] = (float)(((double)t[1] * t[4] - (double)t[0] * t[5]) * invdet);
+}
+
+GradientArena::~GradientArena()
+{
+    // Put the image's own paints back, so that none uses an arena gradient.
+    restore();
+    for (NSVGgradient* gradient : spare) {
+        free(gradient);
+    }
+}
+
+void GradientArena::keepOriginal(Slot& entry, NSVGpaint& paint)
+{
+    if (!entry.paint) {
+        entry.paint = &paint;
+        entry.original = paint;
+    }
+}
+
+void GradientArena::recycle(Slot& entry)
+{
+    if (entry.gradient) {
+        spare.push_back(entry.gradient);
+        entry.gradient = nullptr;
+    }
+}
+
+bool GradientArena::setGradient(NSVGpaint& paint, size_t slot, int nstops, const float* bounds)
+{
+    nstops = std::max(1, std::min(nstops, MAX_GRADIENT_STOPS));
+    if (slot >= slots.size()) slots.resize(slot + 1);
+    Slot& entry = slots[slot];
+    const NSVGpaint own = entry.paint ? entry.original : paint;
+    bool from_arena = IsGradient(paint) && entry.gradient == paint.gradient;
+
+    if (IsGradient(own) && own.gradient->nstops >= nstops) {
+        recycle(entry);
+        paint = own;
+        return true;
+    }
+    if (from_arena) {
+        // Arena gradients have room for MAX_GRADIENT_STOPS.
+        NSVGgradient* gradient = paint.gradient;
+        for (int n = gradient->nstops; n < nstops; ++n) {
+            gradient->stops[n] = gradient->stops[n - 1];
+        }
+        gradient->nstops = std::max(gradient->nstops, nstops);
+        return true;
+    }
+
+    NSVGgradient* gradient = nullptr;
+    if (spare.empty()) {
+        gradient = static_cast<NSVGgradient*>(malloc(sizeof(NSVGgradient) + sizeof(NSVGgradientStop) * (MAX_GRADIENT_STOPS - 1)));
+        if (!gradient) return false;
+        ++allocated;
+    } else {
+        gradient = spare.back();
+        spare.pop_back();
+    }
+
+    signed char type = NSVG_PAINT_LINEAR_GRADIENT;
+    const NSVGgradient* source = IsGradient(paint) ? paint.gradient : IsGradient(own) ? own.gradient : nullptr;
+    if (source) {
+        type = IsGradient(paint) ? paint.type : own.type;
+        memcpy(gradient->xform, source->xform, sizeof(gradient->xform));
+        gradient->spread = source->spread;
+        gradient->fx = source->fx;
+        gradient->fy = source->fy;
+        for (int n = 0; n < nstops; ++n) {
+            gradient->stops[n] = source->stops[std::min(n, source->nstops - 1)];
+        }
+    } else {
+        // Like an SVG linearGradient with the default x1="0%" x2="100%".
+        // nanosvg keeps the transform from user space to the gradient's,
+        // where the gradient runs from (0, 0) to (0, 1).
+        float width = bounds[2] - bounds[0];
+        if (width <= 0.f) width = 1.f;
+        const float to_user[6] = { 0.f, -width, width, 0.f, bounds[0], bounds[1] };
+        InvertTransform(gradient->xform, to_user);
+        gradient->spread = NSVG_SPREAD_PAD;
+        gradient->fx = 0.f;
+        gradient->fy = 0.f;
+        for (int n = 0; n < nstops; ++n) {
+            gradient->stops[n].color = 0;
+            gradient->stops[n].offset = (nstops > 1) ? float(n) / (nstops - 1) : 0.f;
+        }
+    }
+    gradient->nstops = nstops;
+
+    keepOriginal(entry, paint);
+    entry.gradient = gradient;
+    paint.type = type;
+    paint.gradient = gradient;
+    return true;
+}
+
+void GradientArena::releaseGradient(NSVGpaint& paint, size_t slot)
+{
+    if (!IsGradient(paint)) return;
+    if (slot >= slots.size()) slots.resize(slot + 1);
+    Slot& entry = slots[slot];
+    keepOriginal(entry, paint);
+    recycle(entry);
+}
+
+void GradientArena::restore()
+{
+    for (Slot& entry : slots) {
+        recycle(entry);
+        if (entry.paint) {
+            *entry.paint = entry.original;
+            entry.paint = nullptr;
+        }
+    }
+}
+
+void GradientArena::reset()
+{
+    for (Slot& entry : slots) {
+        recycle(entry);
+        entry.paint = nullptr;
+    }
+}
+
+// Counting for SvgThemes::getStats, compiled only with SVG_THEME_STATS.
+#ifdef SVG_THEME_STATS
+#define SVG_THEME_COUNT(...) __VA_ARGS__
+
+static void Count(std::atomic<uint64_t>& counter, uint64_t amount = 1)
+{
+    counter.fetch_add(amount, std::memory_order_relaxed);
+}
+
+// Counts an operation, and adds its time, when it goes out of scope.
+class StatTimer
+{
+public:
+    StatTimer(std::atomic<uint64_t>& count, std::atomic<uint64_t>& ns)
+        : count(count), ns(ns), start(std::chrono::steady_clock::now()) {}
+    ~StatTimer() {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        Count(count);
+        Count(ns, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+    StatTimer(const StatTimer&) = delete;
+    StatTimer& operator=(const StatTimer&) = delete;
+
+private:
+    std::atomic<uint64_t>& count;
+    std::atomic<uint64_t>& ns;
+    std::chrono::steady_clock::time_point start;
+};
+#else
+#define SVG_THEME_COUNT(...)
+#endif
+
+// The ThemeStats counted by SvgThemes itself...
+#define SVG_THEME_CORE_STAT_FIELDS(FIELD) \
+    FIELD(loads) FIELD(load_ns) \
+    FIELD(theme_parses) FIELD(theme_parse_ns) \
+    FIELD(binds) FIELD(bind_ns) FIELD(shapes_visited) FIELD(styles_matched) \
+    FIELD(plans_applied) FIELD(shapes_applied) FIELD(attributes_changed) \
+    FIELD(applies) FIELD(apply_ns) \
+    FIELD(delta_applies) FIELD(delta_apply_ns) \
+    FIELD(restores) FIELD(restore_ns)
+// ...and by the helpers in svt_rack.hpp, through their ThemeExtension.
+#define SVG_THEME_RACK_STAT_FIELDS(FIELD) \
+    FIELD(file_applies) FIELD(file_apply_ns) FIELD(file_cache_hits) FIELD(file_cache_misses) \
+    FIELD(background_jobs) FIELD(background_ns) \
+    FIELD(previews_rendered) FIELD(preview_ns)
+#define SVG_THEME_STAT_FIELDS(FIELD) \
+    SVG_THEME_CORE_STAT_FIELDS(FIELD) \
+    SVG_THEME_RACK_STAT_FIELDS(FIELD)
+
+// Named as in ThemeStats. Workers apply themes too, so they're atomic.
+struct SvgThemes::StatCounters {
+    std::atomic<uint64_t> loads{0}, load_ns{0};
+    std::atomic<uint64_t> theme_parses{0}, theme_parse_ns{0};
+    std::atomic<uint64_t> binds{0}, bind_ns{0}, shapes_visited{0}, styles_matched{0};
+    std::atomic<uint64_t> plans_applied{0}, shapes_applied{0}, attributes_changed{0};
+    std::atomic<uint64_t> applies{0}, apply_ns{0};
+    std::atomic<uint64_t> delta_applies{0}, delta_apply_ns{0};
+    std::atomic<uint64_t> restores{0}, restore_ns{0};
+};
+
+#ifdef SVG_THEME_STATS
+ThemeStats SvgThemes::getStats() const
+{
+    ThemeStats stats;
+#define SVG_THEME_STAT_GET(name) stats.name = counters->name.load(std::memory_order_relaxed);
+    SVG_THEME_CORE_STAT_FIELDS(SVG_THEME_STAT_GET)
+#undef SVG_THEME_STAT_GET
+    ThemeExtension* ext = getExtension();
+    if (ext) ext->addStats(stats);
+    return stats;
+}
+
+void SvgThemes::resetStats()
+{
+#define SVG_THEME_STAT_RESET(name) counters->name.store(0, std::memory_order_relaxed);
+    SVG_THEME_CORE_STAT_FIELDS(SVG_THEME_STAT_RESET)
+#undef SVG_THEME_STAT_RESET
+    ThemeExtension* ext = getExtension();
+    if (ext) ext->resetStats();
+}
+
+std::string ThemeStats::toJson() const
+{
+    json_t* root = json_object();
+#define SVG_THEME_STAT_JSON(name) json_object_set_new(root, #name, json_integer(static_cast<json_int_t>(name)));
+    SVG_THEME_STAT_FIELDS(SVG_THEME_STAT_JSON)
+#undef SVG_THEME_STAT_JSON
+    char* text = json_dumps(root, JSON_COMPACT);
+    json_decref(root);
+    if (!text) return std::string();
+    std::string result(text);
+    free(text);
+    return result;
+}
+#else
+ThemeStats SvgThemes::getStats() const { return ThemeStats(); }
+void SvgThemes::resetStats() {}
+std::string ThemeStats::toJson() const { return "{}"; }
+#endif
+
+std::shared_ptr<Theme> SvgThemes::findTheme(const std::string& name)
+{
+    auto r = std::find_if(themes.begin(), themes.end(), [=](const std::shared_ptr<Theme> theme) {
+        return 0 == theme->name.compare(name);
+    });
+    return r == themes.end() ? nullptr : *r;
+}
+
+std::shared_ptr<Theme> SvgThemes::getParsedTheme(const std::string& name)
+{
+    auto theme = findTheme(name);
+    if (!theme || unparsed.count(theme.get())) return nullptr;
+    return theme;
+}
+
+std::shared_ptr<Theme> SvgThemes::getTheme(const std::string& name)
+{
+    auto theme = findTheme(name);
+    if (!theme) return nullptr;
+    if (!unparsed.empty() && !parseDeferred(theme)) {
+        themes.erase(std::find(themes.begin(), themes.end(), theme));
+        return nullptr;
+    }
+    return theme;
+}
+
+bool SvgThemes::addTheme(const std::string& name, const StyleEntry * styles, size_t count)
+{
+    if (name.empty()) {
+        logError(ErrorCode::NameExpected, "Each theme must have a non-empty name");
+        return false;
+    }
+    auto theme = makeTheme(name, std::string());
+    std::lock_guard<std::mutex> lock(tags_mutex);
+    for (size_t n = 0; n < count; ++n) {
+        const char * tag = styles[n].tag;
+        if (!tag || !*tag) {
+            logError(ErrorCode::NameExpected, "'%s': style %d has no tag", name.c_str(), static_cast<int>(n));
+            return false;
+        }
+        theme->setStyle(tags->intern(TagView(tag, strlen(tag))), styles[n].style);
+    }
+
+    auto existing = std::find_if(themes.begin(), themes.end(), [&name](const std::shared_ptr<Theme>& item) {
+        return 0 == item->name.compare(name);
+    });
+    if (existing != themes.end()) {
+        unparsed.erase(existing->get());
+        *existing = theme;
+    } else {
+        themes.push_back(theme);
+    }
+    return true;
+}
+
+std::mutex ThemeRegistry::mutex;
+std::condition_variable ThemeRegistry::load_done;
+std::unordered_map<std::string, ThemeRegistry::Entry> ThemeRegistry::files;
+
+std::shared_ptr<SvgThemes> ThemeRegistry::acquire(const std::string& filename, std::function<void(SvgThemes&)> init)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    // Entries are never removed, so the reference stays valid.
+    Entry& entry = files[filename];
+    load_done.wait(lock, [&entry]() { return !entry.loading; });
+    auto themes = entry.themes.lock();
+    if (themes) return themes;
+    FileStamp stamp;
+    GetFileStamp(filename, stamp);
+    if (entry.failed && stamp == entry.stamp) return nullptr;
+    entry.loading = true;
+    lock.unlock();
+
+    themes = std::make_shared<SvgThemes>();
+    if (init) {
+        init(*themes);
+    }
+    bool ok = themes->load(filename);
+
+    lock.lock();
+    entry.loading = false;
+    entry.failed = !ok;
+    // The stamp from before the load, so that a save during the load is
+    // loaded next time.
+    entry.stamp = stamp;
+    if (ok) {
+        entry.themes = themes;
+    }
+    lock.unlock();
+    load_done.notify_all();
+    return ok ? themes : nullptr;
+}
+
+bool SvgThemes::requireHexColor(const char * hex, const char * name, PackedColor& color)
+{
+    if (ParseHexColor(hex, strlen(hex), color)) return true;
+    logError(ErrorCode::InvalidHexColor, "'%s': invalid hex color: '%s'", name, hex);
+    return false;
+}
+bool SvgThemes::requireArray(json_t* j, const char * name)
+{
+    if (json_is_array(j)) return true;
+    logError(ErrorCode::ArrayExpected, "'%s': array expected", name);
+    return false;
+}
+bool SvgThemes::requireObject(json_t* j, const char * name)
+{
+    if (json_is_object(j)) return true;
+    logError(ErrorCode::ObjectExpected, "'%s': object expected", name);
+    return false;
+}
+bool SvgThemes::requireObjectOrString(json_t* j, const char * name)
+{
+    if (json_is_object(j) || json_is_string(j)) return true;
+    logError(ErrorCode::ObjectOrStringExpected, "'%s': Object or string expected", name);
+    return false;
+}
+bool SvgThemes::requireString(json_t* j, const char * name)
+{
+    if (json_is_string(j)) return true;
+    logError(ErrorCode::StringExpected, "'%s': String expected", name);
+    return false;
+}
+bool SvgThemes::requireNumber(json_t* j, const char * name)
+{
+    if (json_is_number(j)) return true;
+    logError(ErrorCode::NumberExpected, "'%s': Number expected", name);
+    return false;
+}
+bool SvgThemes::requireInteger(json_t* j, const char * name)
+{
+    if (json_is_integer(j)) return true;
+    logError(ErrorCode::IntegerExpected, "'%s': Integer expected", name);
+    return false;
+}
+
+float getNumber(json_t * j)
+{
+    if (json_is_real(j)) return json_real_value(j);
+    if (json_is_number(j)) return json_number_value(j);
+    if (json_is_integer(j)) return static_cast<float>(json_integer_value(j));
+    return 1.f;
+}
+
+bool SvgThemes::parseOpacity(json_t * root, Style& style)
+{
+    auto oopacity = json_object_get(root, "opacity");
+    if (oopacity) {
+        if (!requireNumber(oopacity, "opacity")) return false;
+        style.setOpacity(std::max(0.f, std::min(1.f, getNumber(oopacity))));
+    }
+    return true;
+}
+
+bool SvgThemes::parseGradient(json_t* ogradient, Gradient& gradient)
+{
+    bool ok = true;
+    gradient.nstops = 0;
+    if (ogradient) {
+        if (!requireArray(ogradient, "gradient")) return false;
+
+        json_t * item; size_t n;
+        json_array_foreach(ogradient, n, item) {
+            int index = 0;
+            PackedColor color = 0;
+            float offset = 0.f;
+            if (n >= MAX_GRADIENT_STOPS) {
+                logError(ErrorCode::TooManyGradientStops, "A maximum of %d gradient stops is allowed", MAX_GRADIENT_STOPS);
+                return false;
+            }
+            auto oindex = json_object_get(item, "index");
+            if (oindex) {
+                if (requireInteger(oindex, "index")) {
+                    index = json_integer_value(oindex);
+                    if (index < 0 || index >= MAX_GRADIENT_STOPS) {
+                        logError(ErrorCode::GradientStopIndexOutOfRange, "Gradient stop index must be from 0 to %d", MAX_GRADIENT_STOPS - 1);
+                        index = 0;
+                        ok = false;
+                    } 
                 } else {
                     index = 0;
                     ok = false;
@@ -500,9 +1918,7 @@ bool SvgThemes::parseGradient(json_t* ogradient, Gradient& gradient)
             if (ocolor) {
                 if (requireString(ocolor, "color")) {
                     auto hex = json_string_value(ocolor);
-                    if (requireValidHexColor(hex, "color")) {
-                        color = parseColor(hex);
-                    } else {
+                    if (!requireHexColor(hex, "color", color)) {
                         color = 0;
                         ok = false;
                     }
@@ -523,20 +1939,17 @@ bool SvgThemes::parseGradient(json_t* ogradient, Gradient& gradient)
             }
 
             if (ok) {
-                gradient.stops[index] = GradientStop(index, offset, color);
+                gradient.setStop(GradientStop(index, offset, color));
             }
         }
-        if (ok) {
-            int count = 0;
-            if (gradient.stops[0].index >= 0) ++count;
-            if (gradient.stops[1].index >= 0) ++count;
-            gradient.nstops = count;
+        if (!ok) {
+            gradient.nstops = 0;
         }
     }
     return ok;
 }
 
-bool SvgThemes::parseFill(json_t* root, std::shared_ptr<Style> style)
+bool SvgThemes::parseFill(json_t* root, Style& style)
 {
     auto ofill = json_object_get(root, "fill");
     if (!ofill) return true;
@@ -544,18 +1957,20 @@ bool SvgThemes::parseFill(json_t* root, std::shared_ptr<Style> style)
     if (json_is_string(ofill)) {
         auto value = json_string_value(ofill);
         if (0 == strcmp(value, "none")) {
-            style->fill.setNone();
+            style.fill.setNone();
         } else {
-            if (!requireValidHexColor(value, "fill")) return false;
-            style->fill.setColor(parseColor(value));
+            PackedColor color;
+            if (!requireHexColor(value, "fill", color)) return false;
+            style.fill.setColor(color);
         }
     } else {
         auto ocolor = json_object_get(ofill, "color");
         if (ocolor) {
             if (!requireString(ocolor, "color")) return false;
             auto hex = json_string_value(ocolor);
-            if (!requireValidHexColor(hex, "color")) return false;
-            style->fill.setColor(parseColor(hex));
+            PackedColor color;
+            if (!requireHexColor(hex, "color", color)) return false;
+            style.fill.setColor(color);
         }
         auto ogradient = json_object_get(ofill, "gradient");
         if (ogradient) {
@@ -565,14 +1980,14 @@ bool SvgThemes::parseFill(json_t* root, std::shared_ptr<Style> style)
             }
             Gradient gradient;
             if (parseGradient(ogradient, gradient) && gradient.nstops > 0) {
-                style->fill.setGradient(gradient);
+                style.fill.setGradient(gradient);
             }
         }
     }
     return true;
 }
 
-bool SvgThemes::parseStroke(json_t* root, std::shared_ptr<Style> style)
+bool SvgThemes::parseStroke(json_t* root, Style& style)
 {
     auto ostroke = json_object_get(root, "stroke");
     if (ostroke) {
@@ -581,24 +1996,26 @@ bool SvgThemes::parseStroke(json_t* root, std::shared_ptr<Style> style)
         if (json_is_string(ostroke)) {
             auto value = json_string_value(ostroke);
             if (0 == strcmp(value, "none")) {
-                style->stroke.setNone();
+                style.stroke.setNone();
             } else {
-                if (!requireValidHexColor(value, "stroke")) return false;
-                style->stroke.setColor(parseColor(value));
+                PackedColor color;
+                if (!requireHexColor(value, "stroke", color)) return false;
+                style.stroke.setColor(color);
             }
         } else {
             auto owidth = json_object_get(ostroke, "width");
             if (owidth) {
                 if (!requireNumber(owidth, "width")) return false;
-                style->setStrokeWidth(getNumber(owidth));
+                style.setStrokeWidth(getNumber(owidth));
             }
 
             auto ocolor = json_object_get(ostroke, "color");
             if (ocolor) {
                 if (!requireString(ocolor, "color")) return false;
                 auto hex = json_string_value(ocolor);
-                if (!requireValidHexColor(hex, "color")) return false;
-                style->stroke.setColor(parseColor(hex));
+                PackedColor color;
+                if (!requireHexColor(hex, "color", color)) return false;
+                style.stroke.setColor(color);
             }
 
             auto ogradient = json_object_get(ostroke, "gradient");
@@ -609,7 +2026,7 @@ bool SvgThemes::parseStroke(json_t* root, std::shared_ptr<Style> style)
                 }
                 Gradient gradient;
                 if (parseGradient(ogradient, gradient) && gradient.nstops > 0) {
-                    style->stroke.setGradient(gradient);
+                    style.stroke.setGradient(gradient);
                 }
             }
         }
@@ -617,18 +2034,16 @@ bool SvgThemes::parseStroke(json_t* root, std::shared_ptr<Style> style)
     return true;
 }
 
-bool SvgThemes::parseStyle(const char * name, json_t* root, std::shared_ptr<Theme> theme)
+bool SvgThemes::parseStyle(const char * name, json_t* root, Style& style)
 {
-    logInfo(format_string("Parsing '%s'", name));
-    auto style = std::make_shared<Style>();
+    logInfo("Parsing '%s'", name);
     if (!parseFill(root, style)) return false;
     if (!parseStroke(root, style)) return false;
     if (!parseOpacity(root, style)) return false;
-    theme->styles[name] = style;
     return true;
 }
 
-bool SvgThemes::parseTheme(json_t* root, std::shared_ptr<Theme> theme)
+bool SvgThemes::parseTheme(json_t* root, std::shared_ptr<Theme> theme, const NamedStyles& named)
 {
     void * n = nullptr;
     const char* key = nullptr;
@@ -636,21 +2051,86 @@ bool SvgThemes::parseTheme(json_t* root, std::shared_ptr<Theme> theme)
 
     json_object_foreach_safe(root, n, key, j) {
         if (json_is_object(j)) {
-            if (!parseStyle(key, j, theme)) return false;
+            Style style;
+            if (!parseStyle(key, j, style)) return false;
+            theme->setStyle(theme->tags->intern(TagView(key, strlen(key))), style);
+        } else if (json_is_string(j)) {
+            if (!useNamedStyle(*theme, key, json_string_value(j), named)) return false;
         } else {
-            logError(ErrorCode::ObjectExpected, format_string("Theme '%s': Each style must be an object", theme->name.c_str()));
+            logError(ErrorCode::ObjectOrStringExpected, "Theme '%s': Each style must be an object, or the name of a shared style", theme->name.c_str());
             return false;
         }
     }
     return true;
 }
 
+bool SvgThemes::parseNamedStyles(json_t* root, NamedStyles& named)
+{
+    void * n = nullptr;
+    const char* key = nullptr;
+    json_t* j = nullptr;
+
+    json_object_foreach_safe(root, n, key, j) {
+        if (!requireObject(j, key)) return false;
+        Style style;
+        if (!parseStyle(key, j, style)) return false;
+        named[key] = style.isApplicable() ? pool->intern(style) : nullptr;
+    }
+    return true;
+}
+
+std::shared_ptr<Theme> SvgThemes::makeTheme(const std::string& name, const std::string& filename)
+{
+    auto theme = std::make_shared<Theme>();
+    theme->name = name;
+    theme->file = filename;
+    theme->tags = tags;
+    theme->pool = pool;
+    return theme;
+}
+
+bool SvgThemes::extendTheme(Theme& theme, const std::string& base,
+    std::vector<std::shared_ptr<Theme>>::const_iterator begin,
+    std::vector<std::shared_ptr<Theme>>::const_iterator end)
+{
+    auto found = std::find_if(begin, end, [&base](const std::shared_ptr<Theme>& item) {
+        return 0 == item->name.compare(base);
+    });
+    if (found == end) {
+        logError(ErrorCode::UnknownTheme, "Theme '%s' extends '%s', which must be a theme earlier in the file",
+            theme.name.c_str(), base.c_str());
+        return false;
+    }
+    theme.inherit(**found);
+    return true;
+}
+
+bool SvgThemes::useNamedStyle(Theme& theme, const std::string& tag, const std::string& style_name, const NamedStyles& named)
+{
+    auto found = named.find(style_name);
+    if (found == named.end()) {
+        logError(ErrorCode::UnknownStyle, "Theme '%s': '%s' uses '%s', which must be a shared style defined before the theme",
+            theme.name.c_str(), tag.c_str(), style_name.c_str());
+        return false;
+    }
+    theme.setStyle(theme.tags->intern(TagView(tag)), found->second);
+    return true;
+}
+
 bool SvgThemes::load(const std::string& filename)
 {
+    SVG_THEME_COUNT(StatTimer timer(counters->loads, counters->load_ns));
+    // Loading adds to the tag table that prewarm workers bind against.
+    waitPrewarm();
+    if (lazy) {
+        if (!loadLazy(filename)) return false;
+        trackFile(filename, Loader::Json);
+        return true;
+    }
     bool ok = true;
 	FILE* file = std::fopen(filename.c_str(), "r");
 	if (!file) {
-        log(Severity::Critical, ErrorCode::CannotOpenJsonFile, filename.c_str());
+        logMessage(Severity::Critical, ErrorCode::CannotOpenJsonFile, "%s", filename.c_str());
         return false;
     }
 
@@ -658,29 +2138,45 @@ bool SvgThemes::load(const std::string& filename)
 	json_t* root = json_loadf(file, 0, &error);
 	if (!root)
     {
-        logError(ErrorCode::JsonParseFailed, format_string("Parse error - %s %d:%d %s",
-            error.source, error.line, error.column, error.text));
+        logError(ErrorCode::JsonParseFailed, "Parse error - %s %d:%d %s",
+            error.source, error.line, error.column, error.text);
         std::fclose(file);
         return false;
     }
 
+    size_t first = themes.size();
+    NamedStyles named;
     if (json_is_array(root)) {
         json_t * item; size_t n;
         json_array_foreach(root, n, item) {
             if (json_is_object(item)) {
-                json_t* j = json_object_get(item, "name");
+                json_t* j = json_object_get(item, "styles");
+                if (j && !json_object_get(item, "name") && !json_object_get(item, "theme")) {
+                    // Shared styles, for the themes that follow
+                    if (!requireObject(j, "styles") || !parseNamedStyles(j, named)) {
+                        ok = false;
+                        break;
+                    }
+                    continue;
+                }
+                j = json_object_get(item, "name");
                 const char * name = nullptr;
                 if (j && json_is_string(j)) {
                     name = json_string_value(j);
                 }
+                json_t* base = json_object_get(item, "extends");
+                if (base && !requireString(base, "extends")) {
+                    ok = false;
+                    break;
+                }
                 if (name && *name) {
+                    // A theme that extends another needs no styles of its own
                     j = json_object_get(item, "theme");
-                    if (j && json_is_object(j)) {
-                        logInfo(format_string("Parsing theme '%s'", name));
-                        auto theme = std::make_shared<Theme>();
-                        theme->name = name;
-                        theme->file = filename;
-                        if (parseTheme(j, theme)) {
+                    if ((j && json_is_object(j)) || (!j && base)) {
+                        logInfo("Parsing theme '%s'", name);
+                        auto theme = makeTheme(name, filename);
+                        if ((!j || parseTheme(j, theme, named))
+                            && (!base || extendTheme(*theme, json_string_value(base), themes.begin() + first, themes.end()))) {
                             themes.push_back(theme);
                         } else {
                             ok = false;
@@ -709,25 +2205,1360 @@ bool SvgThemes::load(const std::string& filename)
 
 	json_decref(root);
     std::fclose(file);
-    if (!ok) {
+    if (ok) {
+        named_styles[filename] = named;
+        trackFile(filename, Loader::Json);
+    } else {
         themes.clear();
+        unparsed.clear();
     }
     return ok;
 }
 
-bool SvgThemes::applyPaint(std::string tag, NSVGpaint & target, Paint& source)
+// A pull tokenizer for JSON, reading from a file in small chunks or from memory.
+// Validates JSON syntax and reports the line and column of each token.
+class JsonReader
 {
-    if (!source.isApplicable()) return false;
+public:
+    enum Token { Error, End, BeginObject, EndObject, BeginArray, EndArray, Key, String, Number, True, False, Null };
 
-    switch (source.Kind()) {
-        case PaintKind::None:
-            if (target.type != NSVG_PAINT_NONE) {
-                if ((target.type == NSVG_PAINT_RADIAL_GRADIENT)
-                    || (target.type == NSVG_PAINT_LINEAR_GRADIENT)) {
-                    logWarning(ErrorCode::RemovingGradientNotSupported, 
-                        format_string("'%s': Removing gradient not supported (leaks memory)", tag.c_str()));
-                    return false;
-                }
+    // Read from a file, a chunk at a time.
+    explicit JsonReader(FILE* file) : file(file) {}
+    // Read from memory. The position of `text` within its file is used for reporting.
+    JsonReader(const char * text, size_t length, int line = 1, int column = 1, size_t offset = 0)
+        : cur(text), end(text + length), base(offset), next_line(line), next_column(column) {}
+
+    // Read the next token.
+    Token next();
+    Token token() const { return current; }
+    // The key or string value of a Key or String token, or the text of a Number.
+    const std::string& text() const { return value; }
+    bool isInteger() const { return integer; }
+    // Read in the C locale, like Jansson: strtod would read 1.5 as 1 once
+    // something sets a locale with a decimal comma.
+    double number() const;
+    // Skip the rest of the current value: for BeginObject or BeginArray, through
+    // the matching end; for a Key, its value; otherwise nothing.
+    bool skip();
+
+    // Position of the start of the current token.
+    int line() const { return token_line; }
+    int column() const { return token_column; }
+    size_t offset() const { return token_offset; }
+    // Byte offset just past the current token.
+    size_t position() const { return consumed; }
+    const std::string& error() const { return message; }
+
+private:
+    enum State { ExpectValue, ExpectValueOrEnd, ExpectKey, ExpectKeyOrEnd, AfterValue };
+
+    FILE* file = nullptr;
+    char buffer[4096];
+    const char * cur = nullptr;
+    const char * end = nullptr;
+    size_t base = 0;
+    size_t consumed = 0;
+    int next_line = 1;
+    int next_column = 1;
+
+    State state = ExpectValue;
+    std::vector<char> stack;
+    Token current = Error;
+    std::string value;
+    bool integer = false;
+    std::string message;
+    int token_line = 1;
+    int token_column = 1;
+    size_t token_offset = 0;
+
+    int peek() {
+        if (cur == end && !fill()) return EOF;
+        return static_cast<unsigned char>(*cur);
+    }
+    int get() {
+        if (cur == end && !fill()) return EOF;
+        int ch = static_cast<unsigned char>(*cur++);
+        ++consumed;
+        if (ch == '\n') {
+            ++next_line;
+            next_column = 1;
+        } else {
+            ++next_column;
+        }
+        return ch;
+    }
+    bool fill() {
+        if (!file) return false;
+        size_t count = std::fread(buffer, 1, sizeof(buffer), file);
+        cur = buffer;
+        end = buffer + count;
+        return count > 0;
+    }
+    Token fail(const char * text) {
+        message = text;
+        current = Error;
+        return Error;
+    }
+    Token readString();
+    Token readNumber(int first);
+    Token readLiteral(int first);
+    bool readHex4(unsigned int& code);
+    void appendUtf8(unsigned int code);
+};
+
+JsonReader::Token JsonReader::next()
+{
+    if (current == Error && !message.empty()) return Error;
+    if (state == AfterValue && stack.empty() && current == End) return End;
+
+    for (;;) {
+        int ch = peek();
+        while (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r') {
+            get();
+            ch = peek();
+        }
+        token_line = next_line;
+        token_column = next_column;
+        token_offset = base + consumed;
+        ch = get();
+        if (ch == EOF) {
+            if (state == AfterValue && stack.empty()) {
+                current = End;
+                return End;
+            }
+            return fail("unexpected end of input");
+        }
+
+        switch (state) {
+        case AfterValue:
+            if (stack.empty()) return fail("end of input expected");
+            if (ch == ',') {
+                state = stack.back() == '{' ? ExpectKey : ExpectValue;
+                continue;
+            }
+            if (ch == '}' && stack.back() == '{') {
+                stack.pop_back();
+                return current = EndObject;
+            }
+            if (ch == ']' && stack.back() == '[') {
+                stack.pop_back();
+                return current = EndArray;
+            }
+            return fail(stack.back() == '{' ? "',' or '}' expected" : "',' or ']' expected");
+
+        case ExpectKeyOrEnd:
+            if (ch == '}') {
+                stack.pop_back();
+                state = AfterValue;
+                return current = EndObject;
+            }
+            // fall through
+        case ExpectKey: {
+            if (ch != '"') return fail("string or '}' expected");
+            if (readString() == Error) return Error;
+            int colon = peek();
+            while (colon == ' ' || colon == '\t' || colon == '\n' || colon == '\r') {
+                get();
+                colon = peek();
+            }
+            if (get() != ':') return fail("':' expected");
+            state = ExpectValue;
+            return current = Key;
+        }
+
+        case ExpectValueOrEnd:
+            if (ch == ']') {
+                stack.pop_back();
+                state = AfterValue;
+                return current = EndArray;
+            }
+            // fall through
+        case ExpectValue:
+            state = AfterValue;
+            switch (ch) {
+                case '{':
+                    stack.push_back('{');
+                    state = ExpectKeyOrEnd;
+                    return current = BeginObject;
+                case '[':
+                    stack.push_back('[');
+                    state = ExpectValueOrEnd;
+                    return current = BeginArray;
+                case '"':
+                    if (readString() == Error) return Error;
+                    return current = String;
+                case 't': case 'f': case 'n':
+                    return readLiteral(ch);
+                default:
+                    if (ch == '-' || (ch >= '0' && ch <= '9')) return readNumber(ch);
+                    return fail("invalid token");
+            }
+        }
+    }
+}
+
+bool JsonReader::readHex4(unsigned int& code)
+{
+    code = 0;
+    for (int n = 0; n < 4; ++n) {
+        int ch = get();
+        int nibble = (ch == EOF) ? -1 : hex_value(static_cast<unsigned char>(ch));
+        if (nibble < 0) return false;
+        code = (code << 4) | nibble;
+    }
+    return true;
+}
+
+void JsonReader::appendUtf8(unsigned int code)
+{
+    if (code < 0x80) {
+        value.push_back(static_cast<char>(code));
+    } else if (code < 0x800) {
+        value.push_back(static_cast<char>(0xC0 | (code >> 6)));
+        value.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    } else if (code < 0x10000) {
+        value.push_back(static_cast<char>(0xE0 | (code >> 12)));
+        value.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+        value.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    } else {
+        value.push_back(static_cast<char>(0xF0 | (code >> 18)));
+        value.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+        value.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+        value.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    }
+}
+
+JsonReader::Token JsonReader::readString()
+{
+    value.clear();
+    for (;;) {
+        int ch = get();
+        if (ch == EOF) return fail("unterminated string");
+        if (ch == '"') return String;
+        if (ch < 0x20) return fail("control character in string");
+        if (ch != '\\') {
+            value.push_back(static_cast<char>(ch));
+            continue;
+        }
+        ch = get();
+        switch (ch) {
+            case '"': value.push_back('"'); break;
+            case '\\': value.push_back('\\'); break;
+            case '/': value.push_back('/'); break;
+            case 'b': value.push_back('\b'); break;
+            case 'f': value.push_back('\f'); break;
+            case 'n': value.push_back('\n'); break;
+            case 'r': value.push_back('\r'); break;
+            case 't': value.push_back('\t'); break;
+            case 'u': {
+                unsigned int code;
+                if (!readHex4(code)) return fail("invalid \\u escape");
+                if (code >= 0xD800 && code <= 0xDBFF) {
+                    unsigned int low;
+                    if (get() != '\\' || get() != 'u' || !readHex4(low) || low < 0xDC00 || low > 0xDFFF) {
+                        return fail("invalid \\u surrogate pair");
+                    }
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                } else if (code >= 0xDC00 && code <= 0xDFFF) {
+                    return fail("invalid \\u surrogate pair");
+                }
+                appendUtf8(code);
+            } break;
+            default:
+                return fail("invalid escape");
+        }
+    }
+}
+
+JsonReader::Token JsonReader::readNumber(int first)
+{
+    value.assign(1, static_cast<char>(first));
+    integer = true;
+    auto digits = [this]() {
+        int count = 0;
+        for (int ch = peek(); ch >= '0' && ch <= '9'; ch = peek()) {
+            value.push_back(static_cast<char>(get()));
+            ++count;
+        }
+        return count;
+    };
+    if (first == '-') {
+        int ch = peek();
+        if (ch < '0' || ch > '9') return fail("invalid number");
+        value.push_back(static_cast<char>(get()));
+        first = ch;
+    }
+    if (first != '0') {
+        digits();
+    }
+    if (peek() == '.') {
+        integer = false;
+        value.push_back(static_cast<char>(get()));
+        if (0 == digits()) return fail("invalid number");
+    }
+    if (peek() == 'e' || peek() == 'E') {
+        integer = false;
+        value.push_back(static_cast<char>(get()));
+        if (peek() == '+' || peek() == '-') {
+            value.push_back(static_cast<char>(get()));
+        }
+        if (0 == digits()) return fail("invalid number");
+    }
+    return current = Number;
+}
+
+double JsonReader::number() const
+{
+    // Theme numbers are short decimals: up to 15 digits scaled by at most
+    // 10^22 are exact as doubles, so one multiply or divide rounds correctly.
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    const char * p = value.c_str();
+    bool negative = (*p == '-');
+    if (negative) ++p;
+    uint64_t mantissa = 0;
+    int scale = 0;
+    bool exact = true;
+    bool fraction = false;
+    for (; (*p >= '0' && *p <= '9') || *p == '.'; ++p) {
+        if (*p == '.') {
+            fraction = true;
+        } else if (mantissa < 100000000000000ull) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (fraction) --scale;
+        } else {
+            exact = false;
+        }
+    }
+    if (*p == 'e' || *p == 'E') {
+        ++p;
+        bool negative_exponent = (*p == '-');
+        if (*p == '-' || *p == '+') ++p;
+        int exponent = 0;
+        for (; *p >= '0' && *p <= '9' && exponent < 1000; ++p) {
+            exponent = exponent * 10 + (*p - '0');
+        }
+        scale += negative_exponent ? -exponent : exponent;
+    }
+    if (exact && scale >= -22 && scale <= 22) {
+        double result = static_cast<double>(mantissa);
+        result = scale < 0 ? result / powers[-scale] : result * powers[scale];
+        return negative ? -result : result;
+    }
+    std::istringstream stream(value);
+    stream.imbue(std::locale::classic());
+    double result = 0;
+    stream >> result;
+    return result;
+}
+
+JsonReader::Token JsonReader::readLiteral(int first)
+{
+    const char * rest = first == 't' ? "rue" : first == 'f' ? "alse" : "ull";
+    for (; *rest; ++rest) {
+        if (get() != *rest) return fail("invalid literal");
+    }
+    return current = (first == 't' ? True : first == 'f' ? False : Null);
+}
+
+bool JsonReader::skip()
+{
+    if (current == Key) {
+        if (next() == Error) return false;
+    }
+    if (current == BeginObject || current == BeginArray) {
+        size_t depth = stack.size() - 1;
+        while (stack.size() > depth) {
+            if (next() == Error) return false;
+        }
+    }
+    return current != Error;
+}
+
+template <typename... Args>
+void SvgThemes::logStreamError(ErrorCode code, const JsonReader& reader, const char * fmt, Args... args)
+{
+    if (isLogging(Severity::Error)) {
+        log(Severity::Error, code, format_string(fmt, args...)
+            + format_string(" (line %d, column %d)", reader.line(), reader.column()));
+    }
+}
+
+bool SvgThemes::streamNumber(JsonReader& reader, const char * name, float& value)
+{
+    if (reader.next() != JsonReader::Number) {
+        if (reader.token() != JsonReader::Error) {
+            logStreamError(ErrorCode::NumberExpected, reader, "'%s': Number expected", name);
+        }
+        return false;
+    }
+    value = static_cast<float>(reader.number());
+    return true;
+}
+
+bool SvgThemes::streamColor(JsonReader& reader, const char * name, PackedColor& color)
+{
+    if (reader.next() != JsonReader::String) {
+        if (reader.token() != JsonReader::Error) {
+            logStreamError(ErrorCode::StringExpected, reader, "'%s': String expected", name);
+        }
+        return false;
+    }
+    return requireStreamColor(reader, name, color);
+}
+
+bool SvgThemes::requireStreamColor(const JsonReader& reader, const char * name, PackedColor& color)
+{
+    const std::string& hex = reader.text();
+    if (ParseHexColor(hex.c_str(), hex.size(), color)) return true;
+    logStreamError(ErrorCode::InvalidHexColor, reader, "'%s': invalid hex color: '%s'", name, hex.c_str());
+    return false;
+}
+
+// Reads a gradient array. Returns false on an error in the gradient, leaving
+// the reader positioned after the array unless the JSON itself is invalid.
+bool SvgThemes::streamGradient(JsonReader& reader, Gradient& gradient)
+{
+    gradient.nstops = 0;
+    if (reader.next() != JsonReader::BeginArray) {
+        if (reader.token() != JsonReader::Error) {
+            logStreamError(ErrorCode::ArrayExpected, reader, "'%s': array expected", "gradient");
+            reader.skip();
+        }
+        return false;
+    }
+    bool ok = true;
+    int n = 0;
+    while (reader.next() != JsonReader::EndArray) {
+        if (reader.token() == JsonReader::Error) return false;
+        if (n++ >= MAX_GRADIENT_STOPS) {
+            logStreamError(ErrorCode::TooManyGradientStops, reader, "A maximum of %d gradient stops is allowed", MAX_GRADIENT_STOPS);
+            reader.skip();
+            ok = false;
+            continue;
+        }
+        if (reader.token() != JsonReader::BeginObject) {
+            logStreamError(ErrorCode::ObjectExpected, reader, "'%s': object expected", "gradient");
+            reader.skip();
+            ok = false;
+            continue;
+        }
+        int index = 0;
+        PackedColor color = 0;
+        float offset = 0.f;
+        bool stop_ok = true;
+        while (reader.next() == JsonReader::Key) {
+            const std::string& key = reader.text();
+            if (0 == key.compare("index")) {
+                if (reader.next() == JsonReader::Number && reader.isInteger()) {
+                    index = static_cast<int>(reader.number());
+                    if (index < 0 || index >= MAX_GRADIENT_STOPS) {
+                        logStreamError(ErrorCode::GradientStopIndexOutOfRange, reader, "Gradient stop index must be from 0 to %d", MAX_GRADIENT_STOPS - 1);
+                        index = 0;
+                        stop_ok = false;
+                    }
+                } else {
+                    if (reader.token() == JsonReader::Error) return false;
+                    logStreamError(ErrorCode::IntegerExpected, reader, "'%s': Integer expected", "index");
+                    reader.skip();
+                    stop_ok = false;
+                }
+            } else if (0 == key.compare("color")) {
+                if (!streamColor(reader, "color", color)) {
+                    if (reader.token() == JsonReader::Error) return false;
+                    reader.skip();
+                    stop_ok = false;
+                }
+            } else if (0 == key.compare("offset")) {
+                if (!streamNumber(reader, "offset", offset)) {
+                    if (reader.token() == JsonReader::Error) return false;
+                    reader.skip();
+                    stop_ok = false;
+                }
+            } else {
+                if (!reader.skip()) return false;
+            }
+        }
+        if (reader.token() == JsonReader::Error) return false;
+        if (stop_ok) {
+            gradient.setStop(GradientStop(index, offset, color));
+        }
+        ok = ok && stop_ok;
+    }
+    if (!ok) {
+        gradient.nstops = 0;
+    }
+    return ok;
+}
+
+// Reads a fill or stroke, the current token being its key.
+bool SvgThemes::streamPaint(JsonReader& reader, const char * name, Paint& paint, Style& style)
+{
+    auto token = reader.next();
+    if (token == JsonReader::String) {
+        if (0 == reader.text().compare("none")) {
+            paint.setNone();
+            return true;
+        }
+        PackedColor color;
+        if (!requireStreamColor(reader, name, color)) return false;
+        paint.setColor(color);
+        return true;
+    }
+    if (token != JsonReader::BeginObject) {
+        if (token != JsonReader::Error) {
+            logStreamError(ErrorCode::ObjectOrStringExpected, reader, "'%s': Object or string expected", name);
+        }
+        return false;
+    }
+
+    bool has_color = false;
+    bool has_gradient = false;
+    bool is_stroke = (0 == strcmp(name, "stroke"));
+    while (reader.next() == JsonReader::Key) {
+        const std::string& key = reader.text();
+        if (0 == key.compare("color")) {
+            if (has_gradient) {
+                logStreamError(ErrorCode::OneOfColorOrGradient, reader, "'%s': Only one of 'color' or 'gradient' allowed", name);
+                return false;
+            }
+            PackedColor color;
+            if (!streamColor(reader, "color", color)) return false;
+            paint.setColor(color);
+            has_color = true;
+        } else if (0 == key.compare("gradient")) {
+            if (has_color) {
+                logStreamError(ErrorCode::OneOfColorOrGradient, reader, "'%s': Only one of 'color' or 'gradient' allowed", name);
+                return false;
+            }
+            has_gradient = true;
+            Gradient gradient;
+            if (streamGradient(reader, gradient)) {
+                if (gradient.nstops > 0) {
+                    paint.setGradient(gradient);
+                }
+            } else if (reader.token() == JsonReader::Error) {
+                return false;
+            }
+        } else if (is_stroke && 0 == key.compare("width")) {
+            float width;
+            if (!streamNumber(reader, "width", width)) return false;
+            style.setStrokeWidth(width);
+        } else {
+            if (!reader.skip()) return false;
+        }
+    }
+    return reader.token() == JsonReader::EndObject;
+}
+
+bool SvgThemes::streamStyle(JsonReader& reader, const std::string& name, Style& style)
+{
+    logInfo("Parsing '%s'", name.c_str());
+    while (reader.next() == JsonReader::Key) {
+        const std::string& key = reader.text();
+        if (0 == key.compare("fill")) {
+            if (!streamPaint(reader, "fill", style.fill, style)) return false;
+        } else if (0 == key.compare("stroke")) {
+            if (!streamPaint(reader, "stroke", style.stroke, style)) return false;
+        } else if (0 == key.compare("opacity")) {
+            float opacity;
+            if (!streamNumber(reader, "opacity", opacity)) return false;
+            style.setOpacity(std::max(0.f, std::min(1.f, opacity)));
+        } else {
+            if (!reader.skip()) return false;
+        }
+    }
+    return reader.token() == JsonReader::EndObject;
+}
+
+bool SvgThemes::streamTheme(JsonReader& reader, std::shared_ptr<Theme> theme, const NamedStyles& named)
+{
+    while (reader.next() == JsonReader::Key) {
+        std::string name = reader.text();
+        if (reader.next() == JsonReader::String) {
+            if (!useNamedStyle(*theme, name, reader.text(), named)) return false;
+            continue;
+        }
+        if (reader.token() != JsonReader::BeginObject) {
+            if (reader.token() != JsonReader::Error) {
+                logStreamError(ErrorCode::ObjectOrStringExpected, reader, "Theme '%s': Each style must be an object, or the name of a shared style", theme->name.c_str());
+            }
+            return false;
+        }
+        Style style;
+        if (!streamStyle(reader, name, style)) return false;
+        theme->setStyle(theme->tags->intern(TagView(name)), style);
+    }
+    return reader.token() == JsonReader::EndObject;
+}
+
+bool SvgThemes::streamNamedStyles(JsonReader& reader, NamedStyles& named)
+{
+    if (reader.next() != JsonReader::BeginObject) {
+        if (reader.token() != JsonReader::Error) {
+            logStreamError(ErrorCode::ObjectExpected, reader, "Expected an object for 'styles'");
+        }
+        return false;
+    }
+    while (reader.next() == JsonReader::Key) {
+        std::string name = reader.text();
+        if (reader.next() != JsonReader::BeginObject) {
+            if (reader.token() != JsonReader::Error) {
+                logStreamError(ErrorCode::ObjectExpected, reader, "Expected an object for '%s'", name.c_str());
+            }
+            return false;
+        }
+        Style style;
+        if (!streamStyle(reader, name, style)) return false;
+        named[name] = style.isApplicable() ? pool->intern(style) : nullptr;
+    }
+    return reader.token() == JsonReader::EndObject;
+}
+
+bool SvgThemes::streamThemes(JsonReader& reader, const std::string& filename, std::vector<std::shared_ptr<Theme>>& loaded, NamedStyles& named)
+{
+    if (reader.next() != JsonReader::BeginArray) {
+        if (reader.token() != JsonReader::Error) {
+            logStreamError(ErrorCode::ArrayExpected, reader, "The top level element must be an array");
+        }
+        return false;
+    }
+    while (reader.next() != JsonReader::EndArray) {
+        if (reader.token() == JsonReader::Error) return false;
+        if (reader.token() != JsonReader::BeginObject) {
+            logStreamError(ErrorCode::ObjectExpected, reader, "Expected a 'theme' object");
+            return false;
+        }
+
+        // "name", "extends", and "theme" may appear in any order
+        auto theme = makeTheme(std::string(), filename);
+        std::string base;
+        bool has_name = false;
+        bool has_theme = false;
+        bool has_styles = false;
+        while (reader.next() == JsonReader::Key) {
+            if (0 == reader.text().compare("name")) {
+                if (reader.next() == JsonReader::String) {
+                    theme->name = reader.text();
+                    has_name = !theme->name.empty();
+                } else if (!reader.skip()) {
+                    return false;
+                }
+            } else if (0 == reader.text().compare("extends")) {
+                if (reader.next() != JsonReader::String) {
+                    if (reader.token() != JsonReader::Error) {
+                        logStreamError(ErrorCode::StringExpected, reader, "Expected a theme name for 'extends'");
+                    }
+                    return false;
+                }
+                base = reader.text();
+            } else if (0 == reader.text().compare("theme")) {
+                if (reader.next() == JsonReader::BeginObject) {
+                    if (!theme->name.empty()) {
+                        logInfo("Parsing theme '%s'", theme->name.c_str());
+                    }
+                    if (!streamTheme(reader, theme, named)) return false;
+                    has_theme = true;
+                } else if (!reader.skip()) {
+                    return false;
+                }
+            } else if (0 == reader.text().compare("styles")) {
+                // Shared styles, for the themes that follow
+                if (!streamNamedStyles(reader, named)) return false;
+                has_styles = true;
+            } else if (!reader.skip()) {
+                return false;
+            }
+        }
+        if (reader.token() == JsonReader::Error) return false;
+        if (has_styles && !has_name && !has_theme) continue;
+        if (!has_name) {
+            logStreamError(ErrorCode::NameExpected, reader, "Each theme must have a non-empty name");
+            return false;
+        }
+        // A theme that extends another needs no styles of its own
+        if (!has_theme && base.empty()) {
+            logStreamError(ErrorCode::ThemeExpected, reader, "Expected a 'theme' object");
+            return false;
+        }
+        if (!base.empty() && !extendTheme(*theme, base, loaded.begin(), loaded.end())) return false;
+        loaded.push_back(theme);
+    }
+    if (reader.next() != JsonReader::End) {
+        if (reader.token() != JsonReader::Error) {
+            logStreamError(ErrorCode::JsonParseFailed, reader, "Unexpected content after the top level array");
+        }
+        return false;
+    }
+    return true;
+}
+
+static bool ReadFile(const std::string& filename, std::string& text)
+{
+    FILE* file = std::fopen(filename.c_str(), "rb");
+    if (!file) return false;
+    char buffer[4096];
+    size_t count;
+    while ((count = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        text.append(buffer, count);
+    }
+    bool ok = !std::ferror(file);
+    std::fclose(file);
+    return ok;
+}
+
+bool SvgThemes::loadLazy(const std::string& filename)
+{
+    auto text = std::make_shared<std::string>();
+    if (!ReadFile(filename, *text)) {
+        logMessage(Severity::Critical, ErrorCode::CannotOpenJsonFile, "%s", filename.c_str());
+        return false;
+    }
+
+    JsonReader reader(text->data(), text->size());
+    std::vector<std::shared_ptr<Theme>> loaded;
+    std::vector<ThemeSource> sources;
+    NamedStyles named;
+    bool ok = false;
+    if (reader.next() != JsonReader::BeginArray) {
+        if (reader.token() != JsonReader::Error) {
+            logStreamError(ErrorCode::ArrayExpected, reader, "The top level element must be an array");
+        }
+    } else {
+        ok = true;
+        while (ok && reader.next() != JsonReader::EndArray) {
+            if (reader.token() == JsonReader::Error) {
+                ok = false;
+                break;
+            }
+            if (reader.token() != JsonReader::BeginObject) {
+                logStreamError(ErrorCode::ObjectExpected, reader, "Expected a 'theme' object");
+                ok = false;
+                break;
+            }
+            // Record where the theme is, skipping over its definition.
+            // Shared styles are small, and parsed now.
+            std::string name;
+            ThemeSource source{text, 0, 0, 0, 0, std::string()};
+            bool has_theme = false;
+            bool has_styles = false;
+            while (ok && reader.next() == JsonReader::Key) {
+                if (0 == reader.text().compare("name")) {
+                    if (reader.next() == JsonReader::String) {
+                        name = reader.text();
+                    } else {
+                        ok = reader.skip();
+                    }
+                } else if (0 == reader.text().compare("extends")) {
+                    if (reader.next() == JsonReader::String) {
+                        source.base = reader.text();
+                    } else {
+                        if (reader.token() != JsonReader::Error) {
+                            logStreamError(ErrorCode::StringExpected, reader, "Expected a theme name for 'extends'");
+                        }
+                        ok = false;
+                    }
+                } else if (0 == reader.text().compare("styles")) {
+                    ok = streamNamedStyles(reader, named);
+                    has_styles = true;
+                } else if (0 == reader.text().compare("theme")) {
+                    if (reader.next() == JsonReader::BeginObject) {
+                        source.begin = reader.offset();
+                        source.line = reader.line();
+                        source.column = reader.column();
+                        ok = reader.skip();
+                        source.end = reader.position();
+                        has_theme = true;
+                    } else {
+                        ok = reader.skip();
+                    }
+                } else {
+                    ok = reader.skip();
+                }
+            }
+            if (!ok || reader.token() == JsonReader::Error) {
+                ok = false;
+                break;
+            }
+            if (has_styles && name.empty() && !has_theme) continue;
+            if (name.empty()) {
+                logStreamError(ErrorCode::NameExpected, reader, "Each theme must have a non-empty name");
+                ok = false;
+                break;
+            }
+            if (!has_theme && source.base.empty()) {
+                logStreamError(ErrorCode::ThemeExpected, reader, "Expected a 'theme' object");
+                ok = false;
+                break;
+            }
+            auto theme = makeTheme(name, filename);
+            if (!source.base.empty()) {
+                // Check the base now, so a bad name is reported by load.
+                // Inheriting waits until the theme is parsed.
+                bool found = std::any_of(loaded.begin(), loaded.end(), [&source](const std::shared_ptr<Theme>& item) {
+                    return 0 == item->name.compare(source.base);
+                });
+                if (!found) {
+                    logError(ErrorCode::UnknownTheme, "Theme '%s' extends '%s', which must be a theme earlier in the file",
+                        name.c_str(), source.base.c_str());
+                    ok = false;
+                    break;
+                }
+            }
+            loaded.push_back(theme);
+            sources.push_back(source);
+        }
+        if (ok && reader.next() != JsonReader::End) {
+            if (reader.token() != JsonReader::Error) {
+                logStreamError(ErrorCode::JsonParseFailed, reader, "Unexpected content after the top level array");
+            }
+            ok = false;
+        }
+    }
+    if (!ok && reader.token() == JsonReader::Error) {
+        logError(ErrorCode::JsonParseFailed, "Parse error - %s %d:%d %s",
+            filename.c_str(), reader.line(), reader.column(), reader.error().c_str());
+    }
+
+    if (!ok) {
+        themes.clear();
+        unparsed.clear();
+        return false;
+    }
+    for (size_t n = 0; n < loaded.size(); ++n) {
+        themes.push_back(loaded[n]);
+        unparsed[loaded[n].get()] = sources[n];
+    }
+    named_styles[filename] = named;
+    return true;
+}
+
+bool SvgThemes::parseDeferred(std::shared_ptr<Theme> theme)
+{
+    auto found = unparsed.find(theme.get());
+    if (found == unparsed.end()) return true;
+    ThemeSource source = found->second;
+    unparsed.erase(found);
+
+    // The base comes earlier in the file, so parsing it first can't loop.
+    std::shared_ptr<Theme> base;
+    if (!source.base.empty()) {
+        auto it = std::find_if(themes.begin(), themes.end(), [&](const std::shared_ptr<Theme>& item) {
+            return item != theme && item->file == theme->file && 0 == item->name.compare(source.base);
+        });
+        if (it == themes.end() || !parseDeferred(*it)) {
+            logError(ErrorCode::UnknownTheme, "Theme '%s' extends '%s', which could not be loaded",
+                theme->name.c_str(), source.base.c_str());
+            theme->styles.clear();
+            return false;
+        }
+        base = *it;
+    }
+
+    logInfo("Parsing theme '%s'", theme->name.c_str());
+    SVG_THEME_COUNT(StatTimer timer(counters->theme_parses, counters->theme_parse_ns));
+    std::lock_guard<std::mutex> lock(tags_mutex);
+    bool ok = true;
+    if (source.end > source.begin) {
+        static const NamedStyles no_styles;
+        auto named = named_styles.find(theme->file);
+        JsonReader reader(source.text->data() + source.begin, source.end - source.begin,
+            source.line, source.column, source.begin);
+        ok = (reader.next() == JsonReader::BeginObject)
+            && streamTheme(reader, theme, named != named_styles.end() ? named->second : no_styles);
+        if (!ok && reader.token() == JsonReader::Error) {
+            logError(ErrorCode::JsonParseFailed, "Parse error - %s %d:%d %s",
+                theme->file.c_str(), reader.line(), reader.column(), reader.error().c_str());
+        }
+    }
+    if (ok && base) {
+        theme->inherit(*base);
+    }
+    if (!ok) {
+        theme->styles.clear();
+    }
+    return ok;
+}
+
+void SvgThemes::parseAllDeferred()
+{
+    if (unparsed.empty()) return;
+    auto all = themes;
+    for (auto theme: all) {
+        if (!parseDeferred(theme)) {
+            themes.erase(std::find(themes.begin(), themes.end(), theme));
+        }
+    }
+}
+
+bool SvgThemes::loadStreaming(const std::string& filename)
+{
+    SVG_THEME_COUNT(StatTimer timer(counters->loads, counters->load_ns));
+    // Loading adds to the tag table that prewarm workers bind against.
+    waitPrewarm();
+    FILE* file = std::fopen(filename.c_str(), "rb");
+    if (!file) {
+        logMessage(Severity::Critical, ErrorCode::CannotOpenJsonFile, "%s", filename.c_str());
+        return false;
+    }
+
+    JsonReader reader(file);
+    std::vector<std::shared_ptr<Theme>> loaded;
+    NamedStyles named;
+    bool ok = streamThemes(reader, filename, loaded, named);
+    if (!ok && reader.token() == JsonReader::Error) {
+        logError(ErrorCode::JsonParseFailed, "Parse error - %s %d:%d %s",
+            filename.c_str(), reader.line(), reader.column(), reader.error().c_str());
+    }
+    std::fclose(file);
+
+    if (ok) {
+        themes.insert(themes.end(), loaded.begin(), loaded.end());
+        named_styles[filename] = named;
+        trackFile(filename, Loader::Streaming);
+    } else {
+        themes.clear();
+        unparsed.clear();
+    }
+    return ok;
+}
+
+// Compiled theme format
+//
+// All values are 32-bit in the byte order of the machine that wrote the file.
+// Offsets are from the start of the file. Strings are offsets into the
+// string table, which holds NUL-terminated UTF-8.
+//
+//   CompiledHeader
+//   uint32_t tags[tag_count]            tag name strings, indexed by tag id
+//   CompiledTheme themes[theme_count]
+//   CompiledStyleRef refs[ref_count]    each theme's refs are contiguous
+//   CompiledStyle styles[style_count]   distinct styles, shared by the refs
+//   CompiledStop stops[stop_count]      each gradient's stops are contiguous
+//   char strings[strings_size]
+//
+const uint32_t COMPILED_VERSION = 3;
+const uint32_t COMPILED_BYTE_ORDER = 0x01020304;
+
+struct CompiledHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t size;
+    uint32_t tag_count;
+    uint32_t theme_count;
+    uint32_t ref_count;
+    uint32_t style_count;
+    uint32_t tags_offset;
+    uint32_t themes_offset;
+    uint32_t refs_offset;
+    uint32_t styles_offset;
+    uint32_t stop_count;
+    uint32_t stops_offset;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+};
+
+struct CompiledTheme {
+    uint32_t name;
+    uint32_t first_ref;
+    uint32_t ref_count;
+};
+
+// The style of one tag in a theme.
+struct CompiledStyleRef {
+    uint32_t tag;
+    uint32_t style;
+};
+
+struct CompiledStop {
+    int32_t index;
+    float offset;
+    PackedColor color;
+};
+
+struct CompiledPaint {
+    uint32_t kind; // PaintKind
+    PackedColor color;
+    uint32_t first_stop;
+    uint32_t nstops;
+};
+
+enum CompiledStyleFlags {
+    ApplyOpacity = 1,
+    ApplyStrokeWidth = 2,
+};
+
+struct CompiledStyle {
+    uint32_t flags;
+    float opacity;
+    float stroke_width;
+    CompiledPaint fill;
+    CompiledPaint stroke;
+};
+
+// A read-only memory mapping of a whole file.
+class MappedFile
+{
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+public:
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+
+    bool open(const std::string& filename);
+    ~MappedFile();
+};
+
+#if defined(_WIN32)
+bool MappedFile::open(const std::string& filename)
+{
+    file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || 0 == file_size.QuadPart) return false;
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping) return false;
+    data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!data) return false;
+    size = static_cast<size_t>(file_size.QuadPart);
+    return true;
+}
+
+MappedFile::~MappedFile()
+{
+    if (data) UnmapViewOfFile(data);
+    if (mapping) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+}
+#else
+bool MappedFile::open(const std::string& filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (0 != fstat(fd, &info) || 0 == info.st_size) {
+        ::close(fd);
+        return false;
+    }
+    void * mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) return false;
+    data = static_cast<const unsigned char*>(mapped);
+    size = static_cast<size_t>(info.st_size);
+    return true;
+}
+
+MappedFile::~MappedFile()
+{
+    if (data) munmap(const_cast<unsigned char*>(data), size);
+}
+#endif
+
+#if defined(_WIN32)
+bool GetFileStamp(const std::string& filename, FileStamp& stamp)
+{
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &info)) return false;
+    stamp.mtime = (int64_t(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime;
+    stamp.size = (int64_t(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+    return true;
+}
+#else
+bool GetFileStamp(const std::string& filename, FileStamp& stamp)
+{
+    struct stat info;
+    if (0 != ::stat(filename.c_str(), &info)) return false;
+#if defined(__APPLE__)
+    stamp.mtime = int64_t(info.st_mtimespec.tv_sec) * 1000000000 + info.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+    stamp.mtime = int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#else
+    stamp.mtime = int64_t(info.st_mtime);
+#endif
+    stamp.size = int64_t(info.st_size);
+    return true;
+}
+#endif
+
+static void PackPaint(const Paint& paint, CompiledPaint& packed, std::vector<CompiledStop>& stops)
+{
+    memset(&packed, 0, sizeof(packed));
+    packed.kind = static_cast<uint32_t>(paint.Kind());
+    packed.color = paint.getColor();
+    auto gradient = paint.getGradient();
+    if (gradient) {
+        packed.first_stop = static_cast<uint32_t>(stops.size());
+        packed.nstops = gradient->nstops;
+        for (int n = 0; n < gradient->nstops; ++n) {
+            CompiledStop stop;
+            stop.index = gradient->stops[n].index;
+            stop.offset = gradient->stops[n].offset;
+            stop.color = gradient->stops[n].color;
+            stops.push_back(stop);
+        }
+    }
+}
+
+static bool UnpackPaint(const CompiledPaint& packed, const CompiledStop* stops, uint32_t stop_count, Paint& paint)
+{
+    switch (static_cast<PaintKind>(packed.kind)) {
+        case PaintKind::Unset: break;
+        case PaintKind::Color: paint.setColor(packed.color); break;
+        case PaintKind::None: paint.setNone(); break;
+        case PaintKind::Gradient: {
+            if (packed.nstops > MAX_GRADIENT_STOPS
+                || uint64_t(packed.first_stop) + packed.nstops > stop_count) return false;
+            Gradient gradient;
+            for (uint32_t n = 0; n < packed.nstops; ++n) {
+                const CompiledStop& stop = stops[packed.first_stop + n];
+                if (!gradient.setStop(GradientStop(stop.index, stop.offset, stop.color))) return false;
+            }
+            paint.setGradient(gradient);
+        } break;
+        default: return false;
+    }
+    return true;
+}
+
+bool SvgThemes::saveCompiled(const std::string& filename)
+{
+    parseAllDeferred();
+
+    std::vector<uint32_t> tag_names;
+    std::vector<CompiledTheme> compiled_themes;
+    std::vector<CompiledStyleRef> compiled_refs;
+    std::vector<CompiledStyle> compiled_styles;
+    std::vector<CompiledStop> compiled_stops;
+    std::unordered_map<const Style*, uint32_t> style_index;
+    std::string strings;
+
+    auto add_string = [&strings](const std::string& text) -> uint32_t {
+        auto offset = static_cast<uint32_t>(strings.size());
+        strings.append(text);
+        strings.push_back('\0');
+        return offset;
+    };
+
+    for (size_t id = 0; id < tags->size(); ++id) {
+        tag_names.push_back(add_string(tags->name(static_cast<int>(id))));
+    }
+    for (auto theme: themes) {
+        CompiledTheme compiled;
+        compiled.name = add_string(theme->name);
+        compiled.first_ref = static_cast<uint32_t>(compiled_refs.size());
+        for (size_t id = 0; id < theme->styles.size(); ++id) {
+            const Style* style = theme->findStyle(static_cast<int>(id));
+            if (!style) continue;
+            // Styles are pooled, so a shared style is written once.
+            auto index = style_index.find(style);
+            if (index == style_index.end()) {
+                CompiledStyle packed;
+                memset(&packed, 0, sizeof(packed));
+                packed.flags = (style->isApplyOpacity() ? ApplyOpacity : 0)
+                    | (style->isApplyStrokeWidth() ? ApplyStrokeWidth : 0);
+                packed.opacity = style->opacity;
+                packed.stroke_width = style->stroke_width;
+                PackPaint(style->fill, packed.fill, compiled_stops);
+                PackPaint(style->stroke, packed.stroke, compiled_stops);
+                index = style_index.emplace(style, static_cast<uint32_t>(compiled_styles.size())).first;
+                compiled_styles.push_back(packed);
+            }
+            compiled_refs.push_back(CompiledStyleRef{static_cast<uint32_t>(id), index->second});
+        }
+        compiled.ref_count = static_cast<uint32_t>(compiled_refs.size()) - compiled.first_ref;
+        compiled_themes.push_back(compiled);
+    }
+
+    CompiledHeader header;
+    memcpy(header.magic, "SVTC", 4);
+    header.version = COMPILED_VERSION;
+    header.byte_order = COMPILED_BYTE_ORDER;
+    header.tag_count = static_cast<uint32_t>(tag_names.size());
+    header.theme_count = static_cast<uint32_t>(compiled_themes.size());
+    header.ref_count = static_cast<uint32_t>(compiled_refs.size());
+    header.style_count = static_cast<uint32_t>(compiled_styles.size());
+    header.stop_count = static_cast<uint32_t>(compiled_stops.size());
+    header.tags_offset = sizeof(CompiledHeader);
+    header.themes_offset = header.tags_offset + header.tag_count * sizeof(uint32_t);
+    header.refs_offset = header.themes_offset + header.theme_count * sizeof(CompiledTheme);
+    header.styles_offset = header.refs_offset + header.ref_count * sizeof(CompiledStyleRef);
+    header.stops_offset = header.styles_offset + header.style_count * sizeof(CompiledStyle);
+    header.strings_offset = header.stops_offset + header.stop_count * sizeof(CompiledStop);
+    header.strings_size = static_cast<uint32_t>(strings.size());
+    header.size = header.strings_offset + header.strings_size;
+
+    FILE* file = std::fopen(filename.c_str(), "wb");
+    if (!file) {
+        logMessage(Severity::Critical, ErrorCode::CannotWriteCompiledFile, "%s", filename.c_str());
+        return false;
+    }
+    // An empty vector's data() may be null, which fwrite must not be given.
+    auto write = [file](const void * data, size_t size, size_t count) {
+        return 0 == count || count == std::fwrite(data, size, count, file);
+    };
+    bool ok = write(&header, sizeof(header), 1)
+        && write(tag_names.data(), sizeof(uint32_t), tag_names.size())
+        && write(compiled_themes.data(), sizeof(CompiledTheme), compiled_themes.size())
+        && write(compiled_refs.data(), sizeof(CompiledStyleRef), compiled_refs.size())
+        && write(compiled_styles.data(), sizeof(CompiledStyle), compiled_styles.size())
+        && write(compiled_stops.data(), sizeof(CompiledStop), compiled_stops.size())
+        && write(strings.data(), 1, strings.size());
+    ok = (0 == std::fclose(file)) && ok;
+    if (!ok) {
+        logError(ErrorCode::CannotWriteCompiledFile, "Error writing '%s'", filename.c_str());
+    }
+    return ok;
+}
+
+bool SvgThemes::loadCompiled(const std::string& filename)
+{
+    SVG_THEME_COUNT(StatTimer timer(counters->loads, counters->load_ns));
+    // Loading adds to the tag table that prewarm workers bind against.
+    waitPrewarm();
+    MappedFile file;
+    if (!file.open(filename)) {
+        logMessage(Severity::Critical, ErrorCode::CannotOpenCompiledFile, "%s", filename.c_str());
+        return false;
+    }
+
+    CompiledHeader header;
+    if (file.size < sizeof(header)) {
+        logError(ErrorCode::InvalidCompiledFile, "'%s': not a compiled theme file", filename.c_str());
+        return false;
+    }
+    memcpy(&header, file.data, sizeof(header));
+    if (0 != memcmp(header.magic, "SVTC", 4) || header.byte_order != COMPILED_BYTE_ORDER) {
+        logError(ErrorCode::InvalidCompiledFile, "'%s': not a compiled theme file", filename.c_str());
+        return false;
+    }
+    if (header.version != COMPILED_VERSION) {
+        logError(ErrorCode::InvalidCompiledFile, "'%s': version %u is not supported (expected %u). Recompile the themes.",
+            filename.c_str(), header.version, COMPILED_VERSION);
+        return false;
+    }
+    auto section_ok = [&](uint32_t offset, uint64_t count, size_t item_size) {
+        return (offset % 4 == 0) && (uint64_t(offset) + count * item_size <= header.size);
+    };
+    if (header.size > file.size
+        || !section_ok(header.tags_offset, header.tag_count, sizeof(uint32_t))
+        || !section_ok(header.themes_offset, header.theme_count, sizeof(CompiledTheme))
+        || !section_ok(header.refs_offset, header.ref_count, sizeof(CompiledStyleRef))
+        || !section_ok(header.styles_offset, header.style_count, sizeof(CompiledStyle))
+        || !section_ok(header.stops_offset, header.stop_count, sizeof(CompiledStop))
+        || uint64_t(header.strings_offset) + header.strings_size != header.size
+        || (header.strings_size && file.data[header.size - 1] != 0)) {
+        logError(ErrorCode::InvalidCompiledFile, "'%s': file is damaged", filename.c_str());
+        return false;
+    }
+
+    auto tag_names = reinterpret_cast<const uint32_t*>(file.data + header.tags_offset);
+    auto compiled_themes = reinterpret_cast<const CompiledTheme*>(file.data + header.themes_offset);
+    auto compiled_refs = reinterpret_cast<const CompiledStyleRef*>(file.data + header.refs_offset);
+    auto compiled_styles = reinterpret_cast<const CompiledStyle*>(file.data + header.styles_offset);
+    auto compiled_stops = reinterpret_cast<const CompiledStop*>(file.data + header.stops_offset);
+    auto strings = reinterpret_cast<const char*>(file.data + header.strings_offset);
+
+    // map the file's tag ids to ours
+    std::vector<int> tag_ids(header.tag_count);
+    for (uint32_t n = 0; n < header.tag_count; ++n) {
+        if (tag_names[n] >= header.strings_size) {
+            logError(ErrorCode::InvalidCompiledFile, "'%s': file is damaged", filename.c_str());
+            return false;
+        }
+        const char * name = strings + tag_names[n];
+        tag_ids[n] = tags->intern(TagView(name, strlen(name)));
+    }
+
+    // Each distinct style is unpacked and pooled once.
+    std::vector<const Style*> styles(header.style_count);
+    pool->reserve(header.style_count);
+    for (uint32_t n = 0; n < header.style_count; ++n) {
+        const CompiledStyle& packed = compiled_styles[n];
+        Style style;
+        if (!UnpackPaint(packed.fill, compiled_stops, header.stop_count, style.fill)
+            || !UnpackPaint(packed.stroke, compiled_stops, header.stop_count, style.stroke)) {
+            logError(ErrorCode::InvalidCompiledFile, "'%s': file is damaged", filename.c_str());
+            return false;
+        }
+        if (packed.flags & ApplyOpacity) style.setOpacity(packed.opacity);
+        if (packed.flags & ApplyStrokeWidth) style.setStrokeWidth(packed.stroke_width);
+        styles[n] = style.isApplicable() ? pool->intern(style) : nullptr;
+    }
+
+    std::vector<std::shared_ptr<Theme>> loaded;
+    for (uint32_t n = 0; n < header.theme_count; ++n) {
+        const CompiledTheme& compiled = compiled_themes[n];
+        if (compiled.name >= header.strings_size
+            || uint64_t(compiled.first_ref) + compiled.ref_count > header.ref_count) {
+            logError(ErrorCode::InvalidCompiledFile, "'%s': file is damaged", filename.c_str());
+            return false;
+        }
+        auto theme = makeTheme(strings + compiled.name, filename);
+        theme->styles.resize(tags->size(), nullptr);
+        for (uint32_t i = 0; i < compiled.ref_count; ++i) {
+            const CompiledStyleRef& ref = compiled_refs[compiled.first_ref + i];
+            if (ref.tag >= header.tag_count || ref.style >= header.style_count) {
+                logError(ErrorCode::InvalidCompiledFile, "'%s': file is damaged", filename.c_str());
+                return false;
+            }
+            theme->styles[tag_ids[ref.tag]] = styles[ref.style];
+        }
+        loaded.push_back(theme);
+    }
+    themes.insert(themes.end(), loaded.begin(), loaded.end());
+    trackFile(filename, Loader::Compiled);
+    return true;
+}
+
+bool Paint::operator==(const Paint& other) const
+{
+    if (kind != other.kind) return false;
+    switch (kind) {
+        case PaintKind::Color:
+            return color == other.color;
+
+        case PaintKind::Gradient:
+            if (gradient.nstops != other.gradient.nstops) return false;
+            for (int n = 0; n < gradient.nstops; ++n) {
+                const GradientStop& a = gradient.stops[n];
+                const GradientStop& b = other.gradient.stops[n];
+                if (a.index != b.index || a.offset != b.offset || a.color != b.color) return false;
+            }
+            return true;
+
+        default:
+            return true;
+    }
+}
+
+bool Style::operator==(const Style& other) const
+{
+    return fill == other.fill
+        && stroke == other.stroke
+        && apply_opacity == other.apply_opacity
+        && (!apply_opacity || opacity == other.opacity)
+        && apply_stroke_width == other.apply_stroke_width
+        && (!apply_stroke_width || stroke_width == other.stroke_width);
+}
+
+bool SvgThemes::applyPaint(const NSVGshape* shape, NSVGpaint & target, size_t slot, const Paint& source, GradientArena* gradients)
+{
+    if (!source.isApplicable()) return false;
+
+    switch (source.Kind()) {
+        case PaintKind::None:
+            if (target.type != NSVG_PAINT_NONE) {
+                if (IsGradient(target)) {
+                    if (!gradients) {
+                        logShapeWarning(ErrorCode::RemovingGradientNotSupported, shape, "Removing gradient not supported (leaks memory)");
+                        return false;
+                    }
+                    gradients->releaseGradient(target, slot);
+                }
                 target.type = NSVG_PAINT_NONE;
                 return true;
             }
@@ -736,11 +3567,12 @@ bool SvgThemes::applyPaint(std::string tag, NSVGpaint & target, Paint& source)
         case PaintKind::Color: {
                 auto source_color = source.getColor();
                 if ((target.type != NSVG_PAINT_COLOR) || (target.color != source_color)) {
-                    if ((target.type == NSVG_PAINT_RADIAL_GRADIENT)
-                        || (target.type == NSVG_PAINT_LINEAR_GRADIENT)) {
-                        logWarning(ErrorCode::RemovingGradientNotSupported, 
-                             format_string("'%s': Removing gradient not supported (leaks memory)", tag.c_str()));
-                        return false;
+                    if (IsGradient(target)) {
+                        if (!gradients) {
+                            logShapeWarning(ErrorCode::RemovingGradientNotSupported, shape, "Removing gradient not supported (leaks memory)");
+                            return false;
+                        }
+                        gradients->releaseGradient(target, slot);
                     }
                     target.type = NSVG_PAINT_COLOR;
                     target.color = source_color;
@@ -751,21 +3583,30 @@ bool SvgThemes::applyPaint(std::string tag, NSVGpaint & target, Paint& source)
 
         case PaintKind::Gradient: {
                 auto gradient = source.getGradient();
-                if (!gradient) return false; // unexpected - defensive
+                if (!gradient || 0 == gradient->nstops) return false; // unexpected - defensive
 
-                if (!((target.type == NSVG_PAINT_RADIAL_GRADIENT)
-                    || (target.type == NSVG_PAINT_LINEAR_GRADIENT))) {
-                    logWarning(ErrorCode::GradientNotPresent, 
-                        format_string("'%s': Skipping SVG element without a gradient", tag.c_str()));
+                bool changed = false;
+                // The stops are in order of index.
+                int needed = gradient->stops[gradient->nstops - 1].index + 1;
+                if (gradients && (!IsGradient(target) || target.gradient->nstops < needed)) {
+                    NSVGpaint before = target;
+                    int before_stops = IsGradient(target) ? target.gradient->nstops : 0;
+                    if (!gradients->setGradient(target, slot, needed, shape->bounds)) {
+                        logShapeWarning(ErrorCode::GradientNotPresent, shape, "Out of memory for a gradient");
+                        return false;
+                    }
+                    changed = (target.type != before.type) || (target.gradient != before.gradient)
+                        || (target.gradient->nstops != before_stops);
+                }
+                if (!IsGradient(target)) {
+                    logShapeWarning(ErrorCode::GradientNotPresent, shape, "Skipping SVG element without a gradient");
                     return false;
                 }
 
-                bool changed = false;
                 for (auto n = 0; n < gradient->nstops; ++n) {
                     const GradientStop& stop = gradient->stops[n];
-                    if (stop.index > target.gradient->nstops) {
-                        logWarning(ErrorCode::GradientStopNotPresent, 
-                            format_string("'%s': Gradient stop %d not present in SVG", tag.c_str()));
+                    if (stop.index >= target.gradient->nstops) {
+                        logShapeWarning(ErrorCode::GradientStopNotPresent, shape, "Gradient stop %d not present in SVG", stop.index);
                     } else {
                         NSVGgradientStop& target_stop = target.gradient->stops[stop.index];
                         if (target_stop.offset != stop.offset) {
@@ -788,89 +3629,449 @@ bool SvgThemes::applyPaint(std::string tag, NSVGpaint & target, Paint& source)
 }
 
 
-bool SvgThemes::applyFill(std::string tag, NSVGshape* shape, std::shared_ptr<Style> style)
+bool SvgThemes::applyFill(NSVGshape* shape, int index, const Style& style, GradientArena* gradients)
+{
+    return style.isApplyFill() ? applyPaint(shape, shape->fill, GradientArena::PaintSlot(index, false), style.fill, gradients) : false;
+}
+
+bool SvgThemes::applyStroke(NSVGshape* shape, int index, const Style& style, GradientArena* gradients)
+{
+    return style.isApplyStroke() ? applyPaint(shape, shape->stroke, GradientArena::PaintSlot(index, true), style.stroke, gradients) : false;
+}
+
+std::shared_ptr<ApplyPlan> SvgThemes::bindTheme(std::shared_ptr<Theme> theme, NSVGimage* svg)
+{
+    auto plan = std::make_shared<ApplyPlan>();
+    plan->theme = theme;
+    plan->svg = svg;
+    if (!theme || !svg || !theme->tags) return plan;
+    plan->pool = theme->pool;
+    // Lazy parsing may be adding tags on another thread.
+    std::lock_guard<std::mutex> lock(tags_mutex);
+    SVG_THEME_COUNT(StatTimer timer(counters->binds, counters->bind_ns));
+    int index = 0;
+    for (NSVGshape* shape = svg->shapes; nullptr != shape; shape = shape->next, ++index) {
+        TagView tag = GetTagView(shape);
+        if (tag.empty()) continue;
+        int tag_id = theme->tags->find(tag);
+        auto style = theme->findStyle(tag_id);
+        if (style) {
+            plan->entries.push_back(ApplyPlan::Entry{shape, style, tag_id, index});
+        }
+    }
+    SVG_THEME_COUNT(Count(counters->shapes_visited, index));
+    SVG_THEME_COUNT(Count(counters->styles_matched, plan->entries.size()));
+    return plan;
+}
+
+int SvgThemes::applyStyle(NSVGshape* shape, int index, const Style& style, GradientArena* gradients)
+{
+    int changed = 0;
+    if (style.isApplyOpacity() && (shape->opacity != style.opacity)) {
+        shape->opacity = style.opacity;
+        ++changed;
+    }
+    if (style.isApplyStrokeWidth() && (shape->strokeWidth != style.stroke_width)) {
+        shape->strokeWidth = style.stroke_width;
+        ++changed;
+    }
+    if (applyFill(shape, index, style, gradients)) {
+        ++changed;
+    }
+    if (applyStroke(shape, index, style, gradients)) {
+        ++changed;
+    }
+    return changed;
+}
+
+bool SvgThemes::applyPlan(const ApplyPlan& plan, GradientArena* gradients)
+{
+    bool modified = false;
+    SVG_THEME_COUNT(uint64_t changed = 0);
+    for (const ApplyPlan::Entry& entry : plan.entries) {
+        int attributes = applyStyle(entry.shape, entry.index, *entry.style, gradients);
+        if (attributes) {
+            modified = true;
+            SVG_THEME_COUNT(changed += attributes);
+        }
+    }
+    SVG_THEME_COUNT(Count(counters->plans_applied));
+    SVG_THEME_COUNT(Count(counters->shapes_applied, plan.entries.size()));
+    SVG_THEME_COUNT(Count(counters->attributes_changed, changed));
+    return modified;
+}
+
+ThemedImage::~ThemedImage()
+{
+    if (owner) owner->release(*this);
+    // Put back the image's own gradients for nsvgDelete to free.
+    gradients.restore();
+}
+
+SvgThemes::SvgThemes()
+{
+    SVG_THEME_COUNT(counters.reset(new StatCounters()));
+}
+
+SvgThemes::~SvgThemes()
+{
+    waitPrewarm();
+    auto themed = themed_images;
+    for (ThemedImage* image : themed) {
+        release(*image);
+    }
+    delete extension.exchange(nullptr);
+}
+
+void SvgThemes::track(ThemedImage& image)
+{
+    if (image.owner == this) return;
+    if (image.owner) image.owner->release(image);
+    image.owner = this;
+    themed_images.insert(&image);
+}
+
+void SvgThemes::release(ThemedImage& image)
 {
-    return style->isApplyFill() ? applyPaint(tag, shape->fill, style->fill) : false;
+    themed_images.erase(&image);
+    image.owner = nullptr;
+    image.plans.clear();
+    image.current = nullptr;
 }
 
-bool SvgThemes::applyStroke(std::string tag, NSVGshape* shape, std::shared_ptr<Style> style)
+std::shared_ptr<ApplyPlan> SvgThemes::cachedPlan(std::shared_ptr<Theme> theme, ThemedImage& image)
 {
-    return style->isApplyStroke() ? applyPaint(tag, shape->stroke, style->stroke) : false;
+    auto& plan = image.plans[std::make_pair(static_cast<const Theme*>(nullptr), theme.get())];
+    if (!plan) {
+        plan = bindTheme(theme, image.svg);
+    }
+    return plan;
 }
 
 bool SvgThemes::applyTheme(std::shared_ptr<Theme> theme, NSVGimage* svg)
 {
-    if (!theme || !svg || !svg->shapes) return false;
+    if (!theme || !svg || !svg->shapes || !theme->tags) return false;
+    SVG_THEME_COUNT(StatTimer timer(counters->applies, counters->apply_ns));
+    // Nothing is kept, so walk the shapes directly rather than build a plan
+    // to throw away.
     bool modified = false;
+    SVG_THEME_COUNT(uint64_t visited = 0);
+    SVG_THEME_COUNT(uint64_t matched = 0);
+    SVG_THEME_COUNT(uint64_t changed = 0);
     for (NSVGshape* shape = svg->shapes; nullptr != shape; shape = shape->next) {
-        std::string tag = GetTag(shape);
+        SVG_THEME_COUNT(++visited);
+        TagView tag = GetTagView(shape);
         if (tag.empty()) continue;
-        auto style = theme->getStyle(tag);
-        if (style) {
-            if (style->isApplyOpacity() && (shape->opacity != style->opacity)) {
-                shape->opacity = style->opacity;
-                modified = true;
+        auto style = theme->findStyle(theme->tags->find(tag));
+        if (!style) continue;
+        SVG_THEME_COUNT(++matched);
+        // Without an arena, the paint slot is never used.
+        int attributes = applyStyle(shape, 0, *style, nullptr);
+        if (attributes) {
+            modified = true;
+            SVG_THEME_COUNT(changed += attributes);
+        }
+    }
+    SVG_THEME_COUNT(Count(counters->shapes_visited, visited));
+    SVG_THEME_COUNT(Count(counters->styles_matched, matched));
+    SVG_THEME_COUNT(Count(counters->attributes_changed, changed));
+    return modified;
+}
+
+bool SvgThemes::applyTheme(std::shared_ptr<Theme> theme, ThemedImage& image)
+{
+    if (!theme || !image.svg || !image.svg->shapes) return false;
+    SVG_THEME_COUNT(StatTimer timer(counters->applies, counters->apply_ns));
+    track(image);
+    captureDefaults(image);
+    GradientArena* gradients = &image.gradients;
+    auto plan = cachedPlan(theme, image);
+    image.current = theme;
+    return applyPlan(*plan, gradients);
+}
+
+void SvgThemes::captureDefaults(ThemedImage& themed)
+{
+    ThemedImage::Defaults& image = themed.defaults;
+    if (image.captured) return;
+    image.captured = true;
+    auto capture_gradient = [&image](const NSVGpaint& paint) {
+        if (IsGradient(paint)) {
+            image.own_gradients.push_back(paint.gradient);
+            image.stops.insert(image.stops.end(), paint.gradient->stops, paint.gradient->stops + paint.gradient->nstops);
+        }
+    };
+    for (NSVGshape* shape = themed.svg->shapes; nullptr != shape; shape = shape->next) {
+        // Only tagged shapes can be themed.
+        if (GetTagView(shape).empty()) continue;
+        image.shape.push_back(shape);
+        image.opacity.push_back(shape->opacity);
+        image.stroke_width.push_back(shape->strokeWidth);
+        image.fill.push_back(shape->fill);
+        image.stroke.push_back(shape->stroke);
+        capture_gradient(shape->fill);
+        capture_gradient(shape->stroke);
+    }
+}
+
+static bool SamePaint(const NSVGpaint& a, const NSVGpaint& b)
+{
+    if (a.type != b.type) return false;
+    switch (a.type) {
+        case NSVG_PAINT_COLOR: return a.color == b.color;
+        case NSVG_PAINT_LINEAR_GRADIENT:
+        case NSVG_PAINT_RADIAL_GRADIENT: return a.gradient == b.gradient;
+        default: return true;
+    }
+}
+
+bool SvgThemes::restoreDefault(ThemedImage& themed)
+{
+    SVG_THEME_COUNT(StatTimer timer(counters->restores, counters->restore_ns));
+    const ThemedImage::Defaults& image = themed.defaults;
+    if (!image.captured) return false;
+    themed.current = nullptr;
+
+    bool modified = false;
+    for (size_t n = 0; n < image.shape.size(); ++n) {
+        NSVGshape* shape = image.shape[n];
+        if (shape->opacity != image.opacity[n]) {
+            shape->opacity = image.opacity[n];
+            modified = true;
+        }
+        if (shape->strokeWidth != image.stroke_width[n]) {
+            shape->strokeWidth = image.stroke_width[n];
+            modified = true;
+        }
+        if (!SamePaint(shape->fill, image.fill[n])) {
+            shape->fill = image.fill[n];
+            modified = true;
+        }
+        if (!SamePaint(shape->stroke, image.stroke[n])) {
+            shape->stroke = image.stroke[n];
+            modified = true;
+        }
+    }
+    // Gradients added by themes are no longer in use.
+    themed.gradients.reset();
+    const NSVGgradientStop* stops = image.stops.data();
+    for (NSVGgradient* gradient : image.own_gradients) {
+        size_t bytes = gradient->nstops * sizeof(NSVGgradientStop);
+        if (0 != memcmp(gradient->stops, stops, bytes)) {
+            memcpy(gradient->stops, stops, bytes);
+            modified = true;
+        }
+        stops += gradient->nstops;
+    }
+    return modified;
+}
+
+std::shared_ptr<ThemeDelta> SvgThemes::getThemeDelta(std::shared_ptr<Theme> from, std::shared_ptr<Theme> to)
+{
+    if (!from || !to) return nullptr;
+    auto& delta = deltas[std::make_pair(from.get(), to.get())];
+    if (delta) return delta;
+
+    delta = std::make_shared<ThemeDelta>();
+    delta->from = from;
+    delta->to = to;
+    size_t count = std::max(from->styles.size(), to->styles.size());
+    delta->changed.resize(count, false);
+    // Pooled styles are equal only when they're the same instance.
+    bool pooled = from->pool && from->pool == to->pool;
+    for (size_t id = 0; id < count; ++id) {
+        const Style* a = id < from->styles.size() ? from->styles[id] : nullptr;
+        const Style* b = id < to->styles.size() ? to->styles[id] : nullptr;
+        if (pooled || !a || !b ? a != b : *a != *b) {
+            delta->tags.push_back(static_cast<int>(id));
+            delta->changed[id] = true;
+        }
+    }
+    return delta;
+}
+
+void SvgThemes::waitPrewarm()
+{
+    ThemeExtension* ext = getExtension();
+    if (ext) ext->wait();
+}
+
+ThemeExtension* SvgThemes::setExtension(std::unique_ptr<ThemeExtension> ext)
+{
+    ThemeExtension* current = nullptr;
+    if (ext && extension.compare_exchange_strong(current, ext.get(), std::memory_order_acq_rel)) {
+        return ext.release();
+    }
+    return current;
+}
+
+bool SvgThemes::applyThemeDelta(std::shared_ptr<Theme> from, std::shared_ptr<Theme> to, ThemedImage& image)
+{
+    if (!to || !image.svg || !image.svg->shapes) return false;
+    // Tag ids are comparable only between themes sharing a TagTable.
+    if (!from || !from->tags || from->tags != to->tags) return applyTheme(to, image);
+    if (from == to) return false;
+    SVG_THEME_COUNT(StatTimer timer(counters->delta_applies, counters->delta_apply_ns));
+    track(image);
+    captureDefaults(image);
+    GradientArena* gradients = &image.gradients;
+
+    auto& plan = image.plans[std::make_pair(from.get(), to.get())];
+    if (!plan) {
+        auto full = cachedPlan(to, image);
+        auto delta = getThemeDelta(from, to);
+        plan = std::make_shared<ApplyPlan>();
+        plan->theme = to;
+        plan->pool = full->pool;
+        plan->svg = image.svg;
+        plan->delta = delta;
+        for (const ApplyPlan::Entry& entry : full->entries) {
+            if (delta->isChanged(entry.tag)) {
+                plan->entries.push_back(entry);
             }
-            if (style->isApplyStrokeWidth() && (shape->strokeWidth != style->stroke_width)) {
-                shape->strokeWidth = style->stroke_width;
-                modified = true;
+        }
+    }
+    image.current = to;
+    return applyPlan(*plan, gradients);
+}
+
+void SvgThemes::trackFile(const std::string& filename, Loader loader)
+{
+    auto found = std::find_if(files.begin(), files.end(), [&filename](const ThemeFile& file) {
+        return file.filename == filename;
+    });
+    if (found == files.end()) {
+        found = files.insert(files.end(), ThemeFile{filename, loader, FileStamp()});
+    }
+    found->loader = loader;
+    GetFileStamp(filename, found->stamp);
+}
+
+bool SvgThemes::reload()
+{
+    if (files.empty()) return false;
+    auto now = std::chrono::steady_clock::now();
+    if (now < next_reload_check) return false;
+    next_reload_check = now + reload_interval;
+
+    // Copies, since loading updates `files`.
+    std::vector<ThemeFile> changed;
+    for (const ThemeFile& file : files) {
+        FileStamp stamp;
+        // A file that's missing is likely being saved, so check it next time.
+        if (GetFileStamp(file.filename, stamp) && stamp != file.stamp) {
+            changed.push_back(file);
+        }
+    }
+    if (changed.empty()) return false;
+
+    // Workers may be binding the current themes.
+    waitPrewarm();
+
+    // Load the changed files into an empty set, sharing the tag table so
+    // that tag ids stay valid. The current set is kept until they all load.
+    // The styles go into a fresh pool, so that the replaced styles are freed
+    // once no theme or plan uses them, rather than piling up in one pool
+    // with every save of the file.
+    std::vector<std::shared_ptr<Theme>> current;
+    std::unordered_map<const Theme*, ThemeSource> current_unparsed;
+    auto current_pool = std::make_shared<StylePool>();
+    auto current_named = named_styles;
+    current.swap(themes);
+    current_unparsed.swap(unparsed);
+    current_pool.swap(pool);
+    bool ok = true;
+    for (const ThemeFile& file : changed) {
+        logInfo("Reloading '%s'", file.filename.c_str());
+        switch (file.loader) {
+        case Loader::Json: ok = load(file.filename); break;
+        case Loader::Streaming: ok = loadStreaming(file.filename); break;
+        case Loader::Compiled: ok = loadCompiled(file.filename); break;
+        }
+        if (!ok) break;
+    }
+
+    // Match the reloaded themes to the current ones by file and name.
+    // A lazy theme that's in use is parsed now, so it's ready to re-apply.
+    std::vector<std::pair<std::shared_ptr<Theme>, std::shared_ptr<Theme>>> updated;
+    std::vector<std::shared_ptr<Theme>> added;
+    if (ok) {
+        for (auto theme : themes) {
+            auto match = std::find_if(current.begin(), current.end(), [&theme](const std::shared_ptr<Theme>& item) {
+                return item->file == theme->file && item->name == theme->name;
+            });
+            if (match == current.end()) {
+                added.push_back(theme);
+                continue;
             }
-            if (applyFill(tag, shape, style)) {
-                modified = true;
+            if (!current_unparsed.count(match->get()) && !parseDeferred(theme)) {
+                ok = false;
+                break;
             }
-            if (applyStroke(tag, shape, style)) {
-                modified = true;
+            updated.push_back(std::make_pair(*match, theme));
+        }
+    }
+    current.swap(themes);
+    current_unparsed.swap(unparsed);
+    if (!ok) {
+        // Drop the partly loaded styles.
+        pool.swap(current_pool);
+        named_styles.swap(current_named);
+        // Don't retry a broken file until it's saved again.
+        for (const ThemeFile& file : changed) {
+            trackFile(file.filename, file.loader);
+        }
+        return false;
+    }
+
+    // Swap in the new set. Themes that are still defined are updated in
+    // place, so the theme pointers held by widgets and caches stay valid.
+    std::vector<std::shared_ptr<Theme>> merged;
+    std::vector<std::shared_ptr<Theme>> reloaded;
+    for (auto theme : themes) {
+        auto match = std::find_if(updated.begin(), updated.end(), [&theme](const std::pair<std::shared_ptr<Theme>, std::shared_ptr<Theme>>& item) {
+            return item.first == theme;
+        });
+        if (match != updated.end()) {
+            theme->styles.swap(match->second->styles);
+            theme->pool = match->second->pool;
+            ++theme->version;
+            unparsed.erase(theme.get());
+            auto deferred = current_unparsed.find(match->second.get());
+            if (deferred != current_unparsed.end()) {
+                unparsed[theme.get()] = deferred->second;
             }
+            reloaded.push_back(theme);
+        } else if (std::any_of(changed.begin(), changed.end(), [&theme](const ThemeFile& file) { return file.filename == theme->file; })) {
+            // No longer in its file
+            unparsed.erase(theme.get());
+            continue;
         }
+        merged.push_back(theme);
     }
-    return modified;
+    for (auto theme : added) {
+        merged.push_back(theme);
+        auto deferred = current_unparsed.find(theme.get());
+        if (deferred != current_unparsed.end()) {
+            unparsed[theme.get()] = deferred->second;
+        }
+    }
+    themes.swap(merged);
+    ++version;
+    reapplyReloaded(reloaded);
+    return true;
 }
 
-static std::map<std::tuple<std::string, std::string, std::string>, std::shared_ptr<rack::window::Svg>> svgCacheByTheme;
-
-struct SvgByTheme : rack::window::Svg {
-
-	static std::shared_ptr<rack::window::Svg> load(const std::string& filename, std::shared_ptr<Theme> theme, std::shared_ptr<rack::window::Svg> oldSvg) {
-		const auto& pair = svgCacheByTheme.find(std::tuple<std::string, std::string, std::string>(filename, theme->file, theme->name));
-		if (pair != svgCacheByTheme.end()) {
-			return pair->second;
-		}
-
-		std::shared_ptr<rack::window::Svg> newSvg;
-		try {
-			newSvg = std::make_shared<rack::window::Svg>();
-			newSvg->loadFile(filename);
-		}
-		catch (rack::Exception& e) {
-			WARN("%s", e.what());
-			newSvg = nullptr;
-		}
-		if (newSvg) {
-			svgCacheByTheme[std::tuple<std::string, std::string, std::string>(filename, theme->file, theme->name)] = newSvg;
-            // The caller is responsible for applying the theme
-		}
-		return newSvg;
-	}
-
-	static size_t cacheSize() {return svgCacheByTheme.size();}
-
-	static void showCache() {
-		unsigned int n = 0;
-		for (auto entry : svgCacheByTheme) {
-			DEBUG("%u %s %s %s %p", ++n, std::get<0>(entry.first).c_str(), std::get<1>(entry.first).c_str(), std::get<2>(entry.first).c_str(), (entry.second).get());
-		}
-	}
-};
-
-bool SvgThemes::applyTheme(std::shared_ptr<Theme> theme, std::string filename, std::shared_ptr<rack::window::Svg>& svg) {
-	//check the themed cache for existing relevant svg
-	std::shared_ptr<rack::window::Svg> newSvg = SvgByTheme::load(filename, theme, svg);
-	if (newSvg && (newSvg != svg)) {
-		applyTheme(theme, newSvg->handle);
-		svg = newSvg;
-		return true;
-	}
-	return false;
+void SvgThemes::reapplyReloaded(const std::vector<std::shared_ptr<Theme>>& updated)
+{
+    // Plans and deltas point into the replaced styles.
+    deltas.clear();
+    for (ThemedImage* image : themed_images) {
+        image->plans.clear();
+        if (image->current && std::find(updated.begin(), updated.end(), image->current) != updated.end()) {
+            applyTheme(image->current, *image);
+        }
+    }
 }
 
 #endif // IMPLEMENT_SVG_THEME
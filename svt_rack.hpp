@@ -3,8 +3,24 @@
 
 #ifndef SVG_THEME_RACK_HELP
 #define SVG_THEME_RACK_HELP
+#include <cmath>
+#include <deque>
+#include <list>
+#include <set>
+#include <thread>
 #include <rack.hpp>
 #include "svgtheme.hpp"
+// Theme previews are opt-in: define SVG_THEME_PREVIEWS for every file that
+// includes svt_rack.hpp (such as in your Makefile's FLAGS) to get them.
+#if defined(IMPLEMENT_SVG_THEME) && defined(SVG_THEME_PREVIEWS)
+#ifndef SVG_THEME_NO_NANOSVGRAST
+// Rack doesn't build nanosvg's rasterizer, used for theme previews, so it's
+// built with the rest of the implementation. Define SVG_THEME_NO_NANOSVGRAST
+// if your plugin builds it elsewhere.
+#define NANOSVGRAST_IMPLEMENTATION
+#endif
+#include <nanosvgrast.h>
+#endif
 
 using namespace rack;
 namespace svg_theme {
@@ -22,7 +38,490 @@ bool ApplyChildrenTheme(Widget * widget, SvgThemes& themes, std::shared_ptr<Them
 // Your IThemeHolder::applyTheme(std::string theme) override should update 
 // the themes of visible widgets, and remember the theme.
 //
-void AppendThemeMenu(Menu* menu, IThemeHolder* holder, SvgThemes& themes);
+// With SVG_THEME_PREVIEWS defined and a `previewFile`, usually your panel
+// SVG, each theme shows a thumbnail of that file in the theme. The thumbnails are rendered in the background
+// (see RequestThemePreviews), and appear in the menu as they're ready.
+// Opening the menu never parses a theme: in lazy mode (SvgThemes::setLazy),
+// only the themes already parsed get thumbnails.
+//
+void AppendThemeMenu(Menu* menu, IThemeHolder* holder, SvgThemes& themes, const std::string& previewFile = "");
+
+#ifdef SVG_THEME_PREVIEWS
+// The size of the thumbnails in AppendThemeMenu. Thumbnails fit in a short,
+// wide box, so tall panels and wide logos both show.
+// Request previews of this size to have them ready before the menu opens.
+constexpr int THEME_MENU_PREVIEW_WIDTH = 120;
+constexpr int THEME_MENU_PREVIEW_HEIGHT = 40;
+
+#endif // SVG_THEME_PREVIEWS
+
+// Collects the themeable SVGs of widget trees, so that a theme change is
+// applied once per unique SVG file rather than once per widget.
+// Four ThemeScrews share one themed Screw.svg, and so do all the screws of
+// every module in the batch.
+//
+// ```cpp
+// svg_theme::ThemeBatch batch;
+// for (auto widget : widgets) batch.collect(widget);
+// batch.apply(themes, theme);
+// ```
+//
+class ThemeBatch
+{
+public:
+    // Gives a widget its new SVG through the widget's own setter, such as
+    // SvgWidget::setSvg, so that it updates its size too.
+    typedef std::function<void(std::shared_ptr<rack::window::Svg>)> SvgSetter;
+
+    // Add a widget's SVG, to be replaced with the themed SVG for `file`.
+    // `svg` is the widget's current SVG, which `set` replaces. `owner` is
+    // sent a DirtyEvent when it's replaced.
+    void add(const std::string& file, const std::shared_ptr<rack::window::Svg>& svg, SvgSetter set, Widget* owner);
+    // Add a widget that applies the theme itself.
+    // `owner` is sent a DirtyEvent when the theme modifies it.
+    void add(IApplyTheme* change, Widget* owner);
+
+    // Collect targets from `widget` and its descendants.
+    // Widgets implementing IThemeTargets add their SVG slots. Other widgets
+    // implementing IApplyTheme are applied individually.
+    void collect(Widget* widget);
+
+    // Theme each unique SVG file once, give the result to every target, and
+    // send one DirtyEvent to each widget that changed.
+    // return true if anything was modified.
+    bool apply(SvgThemes& themes, std::shared_ptr<Theme> theme);
+
+    size_t size() const { return targets.size() + widgets.size(); }
+    // The number of unique SVG files among the targets.
+    size_t fileCount() const { return files.size(); }
+    void clear();
+
+private:
+    struct Target {
+        size_t file; // index into files
+        const std::shared_ptr<rack::window::Svg>* svg;
+        SvgSetter set;
+        Widget* owner;
+    };
+    std::vector<std::string> files;
+    std::unordered_map<std::string, size_t> file_index;
+    std::vector<Target> targets;
+    std::vector<std::pair<Widget*, IApplyTheme*>> widgets;
+    // The files' ids in the themed SVG cache with this serial number
+    std::vector<uint32_t> file_ids;
+    uint64_t file_ids_cache = 0;
+    // Kept between applies, so that applying a theme doesn't allocate
+    std::vector<std::shared_ptr<rack::window::Svg>> themed;
+    std::vector<Widget*> dirty;
+};
+
+// Implement IThemeTargets on widgets whose theme is a themed copy of an SVG
+// file, so that ThemeBatch can share the themed SVG between widgets.
+// Keep implementing IApplyTheme too, for ApplyChildrenTheme.
+//
+// ```cpp
+// void addThemeTargets(svg_theme::ThemeBatch& batch) override {
+//     batch.add(file, sw->svg, [this](std::shared_ptr<Svg> svg) { setSvg(svg); }, this);
+// }
+// ```
+//
+struct IThemeTargets
+{
+    virtual void addThemeTargets(ThemeBatch& batch) = 0;
+};
+
+// Like ApplyChildrenTheme, but collects the widget tree into a ThemeBatch,
+// so each unique SVG is themed once and only changed widgets are dirtied.
+//
+bool ApplyChildrenThemeBatch(Widget * widget, SvgThemes& themes, std::shared_ptr<Theme> theme);
+
+// A flat list of the themeable widgets of a module widget, so that a theme
+// change neither walks the widget tree nor needs RTTI.
+// Register each themeable widget as you add it:
+//
+// ```cpp
+// addChild(dispatcher.adopt(createWidget<ThemeScrew>(pos)));
+// ```
+//
+// and then apply themes with `dispatcher.applyTheme(themes, theme)`.
+// Widgets implementing IThemeTargets share themed SVGs through a ThemeBatch.
+// Their targets are collected once, on the first theme change after a
+// widget is added or removed.
+// A widget removed before its module widget is destroyed must be removed
+// from the dispatcher too.
+//
+class ThemeDispatcher
+{
+public:
+    // Register a widget implementing IApplyTheme and/or IThemeTargets.
+    // Returns the widget.
+    template <typename TWidget>
+    TWidget* adopt(TWidget* widget) {
+        add(widget, ApplyThemeOf(widget), ThemeTargetsOf(widget));
+        return widget;
+    }
+    void add(Widget* widget, IApplyTheme* change, IThemeTargets* targets);
+    void remove(Widget* widget);
+
+    // Apply the theme to all registered widgets, sending a DirtyEvent to each
+    // widget that changed. return true if anything was modified.
+    bool applyTheme(SvgThemes& themes, std::shared_ptr<Theme> theme);
+
+    size_t size() const { return entries.size(); }
+
+private:
+    struct Entry {
+        Widget* widget;
+        IApplyTheme* change;
+        IThemeTargets* targets;
+    };
+    std::vector<Entry> entries;
+    // The registered widgets' targets, collected on first use after a change.
+    ThemeBatch batch;
+    bool batch_ready = false;
+
+    // Resolved at compile time: null when the widget lacks the interface.
+    static IApplyTheme* ApplyThemeOf(IApplyTheme* change) { return change; }
+    static IApplyTheme* ApplyThemeOf(...) { return nullptr; }
+    static IThemeTargets* ThemeTargetsOf(IThemeTargets* targets) { return targets; }
+    static IThemeTargets* ThemeTargetsOf(...) { return nullptr; }
+};
+
+struct SvgCacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+// A themed copy of a master SVG that shares the master's paths, and owns
+// only its shapes and gradients (see CloneImageVariant).
+// Create variants with `SvgVariant::create`, so that they are deleted as
+// variants and not with nsvgDelete.
+struct SvgVariant : rack::window::Svg
+{
+    // Keeps the shared paths alive.
+    std::shared_ptr<rack::window::Svg> master;
+    // Gradients the theme added to the variant.
+    GradientArena gradients;
+
+    // Returns nullptr if the master has no image or memory is exhausted.
+    static std::shared_ptr<SvgVariant> create(std::shared_ptr<rack::window::Svg> master);
+
+    ~SvgVariant() {
+        gradients.restore();
+        DeleteImageVariant(handle);
+        handle = nullptr; // so that ~Svg doesn't nsvgDelete it
+    }
+};
+
+// A cache of themed SVGs used by ApplyThemeToSvg, keyed by SVG file and
+// theme. Each SvgThemes has its own, in its ThemeCacheManager.
+//
+// By default the cache is unbounded. With a budget set, the least recently
+// used entries are evicted once the budget is exceeded, but only entries
+// that nobody else holds a reference to. The cache is safe to use from
+// multiple threads.
+class ThemedSvgCache
+{
+public:
+    ThemedSvgCache();
+
+    // A number no other ThemedSvgCache in the process has.
+    uint64_t getSerial() const { return serial; }
+
+    // Limit the cache to `max_entries` entries and about `max_bytes` of image data.
+    // Zero means no limit.
+    void setBudget(size_t max_entries, size_t max_bytes);
+
+    // Get the cached SVG for a file and theme, or nullptr.
+    // An entry themed before the theme was reloaded is out of date, and is
+    // removed rather than returned.
+    std::shared_ptr<rack::window::Svg> find(const std::string& file, const Theme& theme);
+    // Add a themed SVG, ending any claim on it. Returns the cached SVG,
+    // which is an existing entry if another thread added one first.
+    // With a null `svg`, only the claim ends.
+    std::shared_ptr<rack::window::Svg> insert(const std::string& file, const Theme& theme, std::shared_ptr<rack::window::Svg> svg);
+    // The id of an SVG file in this cache, to find and insert by id, which
+    // saves looking up the file name each time. Ids are never reused.
+    uint32_t fileId(const std::string& file);
+    const std::string& fileName(uint32_t file_id);
+    std::shared_ptr<rack::window::Svg> find(uint32_t file_id, const Theme& theme);
+    std::shared_ptr<rack::window::Svg> insert(uint32_t file_id, const Theme& theme, std::shared_ptr<rack::window::Svg> svg);
+    // Reserve a themed SVG for theming in the background.
+    // return false if it's cached for the current version of the theme, or
+    // already being themed.
+    bool claim(const std::string& file, const Theme& theme);
+
+    // Get the unthemed master SVG for a file, loading it on first use.
+    // Themed variants share the master's paths, so each file is read and
+    // parsed only once, and its geometry is in memory once however many
+    // themes are cached. Masters are never themed or evicted, and their
+    // paths are not counted against the budget.
+    std::shared_ptr<rack::window::Svg> getMaster(const std::string& file);
+
+    // Evict unused entries until the cache is within budget.
+    void trim();
+    // Remove all entries and masters.
+    void clear();
+
+    size_t size();
+    SvgCacheStats getStats();
+    void resetStats();
+
+    // Visit each entry, from most to least recently used.
+    void forEach(std::function<void(const std::string& file, const std::string& theme_file, const std::string& theme_name, rack::window::Svg* svg)> visit);
+
+private:
+    struct Entry {
+        uint64_t key;
+        std::shared_ptr<rack::window::Svg> svg;
+        size_t bytes;
+        unsigned int version; // Theme::version when themed
+    };
+    struct ThemeName {
+        std::string file;
+        std::string name;
+    };
+
+    const uint64_t serial;
+    std::mutex mutex;
+    std::list<Entry> lru;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    std::unordered_set<uint64_t> pending; // claimed keys
+    std::unordered_map<std::string, std::shared_ptr<rack::window::Svg>> masters;
+    std::unordered_map<std::string, uint32_t> file_ids;
+    std::unordered_map<std::string, std::unordered_map<std::string, uint32_t>> theme_ids;
+    std::deque<std::string> files; // by id; a deque, so names stay put
+    std::vector<ThemeName> theme_names;
+    size_t max_entries = 0;
+    size_t max_bytes = 0;
+    SvgCacheStats stats;
+
+    uint32_t internFile(const std::string& file);
+    bool findKey(uint32_t file_id, const Theme& theme, uint64_t& key);
+    uint64_t internKey(uint32_t file_id, const Theme& theme);
+    std::shared_ptr<rack::window::Svg> findLocked(uint32_t file_id, const Theme& theme);
+    std::shared_ptr<rack::window::Svg> insertLocked(uint32_t file_id, const Theme& theme, std::shared_ptr<rack::window::Svg> svg);
+    void removeStale(std::unordered_map<uint64_t, std::list<Entry>::iterator>::iterator found);
+    bool overBudget();
+    void evict();
+};
+
+// Apply the theme to an SVG file.
+// This uses the themed SVG cache, indexed by SVG filename and theme, allowing
+// multiple instances of the same module to be independent: `svg` is set to
+// the cached SVG for the theme.
+// return true if `svg` was changed.
+// Use the SVG as is required for your situation.
+bool ApplyThemeToSvg(SvgThemes& themes, std::shared_ptr<Theme> theme, const std::string& svgFile, std::shared_ptr<rack::window::Svg>& svg);
+
+// Load and theme each SVG file for each of the named themes on worker
+// threads, adding the results to the themed SVG cache, so that later calls
+// to ApplyThemeToSvg are cache hits.
+// Returns immediately, skipping SVGs that are cached or already being
+// themed, so calling it again queues only what's missing. In lazy mode,
+// themes that are not parsed yet are skipped, so this never parses: call
+// getTheme first for those you want.
+// The log callback may be called from the worker threads.
+// SvgThemes::waitPrewarm waits for the work to finish.
+void PrewarmThemedSvgs(SvgThemes& themes, const std::vector<std::string>& files, const std::vector<std::string>& theme_names);
+
+// A small pool of worker threads for background theme work, such as
+// PrewarmThemedSvgs.
+// Threads are started as jobs arrive, up to the thread limit, and wait for
+// more work until the pool is shut down, which joins them.
+class ThemeWorkerPool
+{
+public:
+    static ThemeWorkerPool& instance();
+
+    // `max_threads` of zero picks a default from the hardware concurrency,
+    // leaving a core for the UI and audio threads.
+    explicit ThemeWorkerPool(unsigned int max_threads = 0);
+    // Finishes the queued jobs and joins the threads.
+    ~ThemeWorkerPool();
+    ThemeWorkerPool(const ThemeWorkerPool&) = delete;
+    ThemeWorkerPool& operator=(const ThemeWorkerPool&) = delete;
+
+    void submit(std::function<void()> job);
+    // Wait until the queue is empty and all jobs are done.
+    void wait();
+    // Finish the queued jobs and join the threads. Jobs submitted later
+    // start new threads.
+    // Call this on the shared pool from your plugin's destroy(), so that no
+    // worker is still running while the plugin is unloaded.
+    void shutdown();
+
+private:
+    std::mutex mutex;
+    std::condition_variable idle;
+    std::condition_variable work;
+    std::deque<std::function<void()>> jobs;
+    std::vector<std::thread> workers;
+    unsigned int max_threads;
+    unsigned int busy = 0;
+    bool stopping = false;
+
+    void run();
+};
+
+#ifdef SVG_THEME_PREVIEWS
+// A thumbnail of an SVG with a theme applied, from nanosvg's CPU rasterizer.
+struct ThemePreview
+{
+    int width = 0;
+    int height = 0;
+    // RGBA, 4 bytes per pixel, top row first, not premultiplied.
+    std::vector<unsigned char> pixels;
+};
+
+// Rasterize `svg` into `preview`, scaled to fit within `max_width` x
+// `max_height` pixels. return false if the SVG has no size or the rasterizer
+// can't be created.
+bool RenderThemePreview(NSVGimage* svg, int max_width, int max_height, ThemePreview& preview);
+
+// Render a thumbnail of the SVG file in each of the named themes on worker
+// threads, into the ThemePreviewCache, each fitting within `width` x
+// `height` pixels. The themed SVGs come from the themed SVG cache, as for
+// PrewarmThemedSvgs. Returns immediately, skipping previews that are cached
+// or already being rendered, and, like PrewarmThemedSvgs, themes that are not
+// parsed yet, so it's cheap to call whenever a menu opens.
+void RequestThemePreviews(SvgThemes& themes, const std::string& svgFile, const std::vector<std::string>& theme_names, int width, int height);
+
+// A cache of theme previews, keyed by SVG file, theme, and size.
+// Each SvgThemes has its own, in its ThemeCacheManager.
+// RequestThemePreviews renders previews on worker threads, and
+// everything else only looks them up, so drawing a menu never parses or
+// rasterizes an SVG.
+// Once the previews' pixels exceed the budget (4 MB by default), the least
+// recently used previews that nobody else holds are evicted.
+// The cache is safe to use from multiple threads.
+class ThemePreviewCache
+{
+public:
+    // Limit the cache to about `max_bytes` of pixels. Zero means no limit.
+    void setBudget(size_t max_bytes);
+
+    // Get the preview, or nullptr if it isn't rendered yet.
+    // A preview of an older version of the theme is removed rather than returned.
+    std::shared_ptr<const ThemePreview> find(const std::string& file, const Theme& theme, int max_width, int max_height);
+    // Reserve a preview for rendering.
+    // return false if it's cached or already being rendered.
+    bool claim(const std::string& file, const Theme& theme, int max_width, int max_height);
+    // Add a rendered preview, ending the claim. With a null `preview`, only
+    // the claim ends. `version` is the Theme::version it was rendered from.
+    void insert(const std::string& file, const Theme& theme, int max_width, int max_height, unsigned int version, std::shared_ptr<const ThemePreview> preview);
+
+    // Remove all previews.
+    void clear();
+    size_t size();
+    // Bytes of pixels in the cache.
+    size_t bytes();
+
+private:
+    // SVG file, theme file, theme name, maximum width and height
+    typedef std::tuple<std::string, std::string, std::string, int, int> Key;
+    struct Entry {
+        Key key;
+        std::shared_ptr<const ThemePreview> preview;
+        unsigned int version; // Theme::version when rendered
+    };
+
+    std::mutex mutex;
+    std::list<Entry> lru;
+    std::map<Key, std::list<Entry>::iterator> index;
+    std::set<Key> pending;
+    size_t max_bytes = 4 << 20;
+    size_t total_bytes = 0;
+
+    static Key makeKey(const std::string& file, const Theme& theme, int max_width, int max_height) {
+        return Key(file, theme.file, theme.name, max_width, max_height);
+    }
+    void remove(std::map<Key, std::list<Entry>::iterator>::iterator found);
+    void evict();
+};
+
+#endif // SVG_THEME_PREVIEWS
+
+class ThemePreviewCache;
+
+// The helpers' side of an SvgThemes: its themed SVG and preview caches,
+// the jobs PrewarmThemedSvgs and RequestThemePreviews run on the shared
+// ThemeWorkerPool to fill them, and what the helpers count.
+// It's the SvgThemes' ThemeExtension, so it's owned and destroyed by the
+// SvgThemes, SvgThemes::waitPrewarm waits for the jobs, and getStats
+// reports the counts. As the caches belong to one SvgThemes, themes of
+// different SvgThemes never share cache entries, even when they have the
+// same name.
+class ThemeCacheManager : public ThemeExtension
+{
+public:
+    // The manager of `themes`, set as its extension on first use.
+    // Safe on any thread.
+    static ThemeCacheManager& of(SvgThemes& themes);
+
+    ThemeCacheManager();
+    // Waits for the jobs.
+    ~ThemeCacheManager();
+    ThemeCacheManager(const ThemeCacheManager&) = delete;
+    ThemeCacheManager& operator=(const ThemeCacheManager&) = delete;
+
+    // The themed SVGs of ApplyThemeToSvg and PrewarmThemedSvgs.
+    ThemedSvgCache& svgCache() { return svgs; }
+#ifdef SVG_THEME_PREVIEWS
+    // The previews of RequestThemePreviews. Theme menu items share it, as
+    // they can outlive the SvgThemes.
+    std::shared_ptr<ThemePreviewCache> previewCache() { return previews; }
+#endif
+
+    // Run a job on the shared worker pool, counted for wait().
+    void submit(std::function<void()> job);
+
+    void wait() override;
+    void addStats(ThemeStats& stats) const override;
+    void resetStats() override;
+
+    // The helpers' counters, named as in ThemeStats, or nullptr unless the
+    // implementation defines SVG_THEME_STATS.
+    struct Counters;
+    Counters* statCounters() { return counters.get(); }
+
+private:
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t pending = 0;
+    std::unique_ptr<Counters> counters;
+    ThemedSvgCache svgs;
+    std::shared_ptr<ThemePreviewCache> previews; // null without SVG_THEME_PREVIEWS
+};
+
+#ifdef SVG_THEME_PREVIEWS
+// A theme menu item with a thumbnail of the theme, made by AppendThemeMenu
+// when it's given a preview file. The thumbnail is drawn once the preview
+// cache has it.
+struct ThemePreviewMenuItem : rack::ui::MenuItem
+{
+    IThemeHolder* holder = nullptr;
+    std::shared_ptr<Theme> theme; // the theme named by `text`, if it's parsed
+    std::shared_ptr<ThemePreviewCache> previews;
+    std::string file;
+    int preview_width = 0;
+    int preview_height = 0;
+
+    ~ThemePreviewMenuItem();
+    void step() override;
+    void draw(const DrawArgs& args) override;
+    void onAction(const ActionEvent&) override;
+
+private:
+    std::shared_ptr<const ThemePreview> preview;
+    int image = 0; // nanovg image of the preview
+    NVGcontext* image_vg = nullptr; // the context that created `image`, which must delete it
+};
+
+#endif // SVG_THEME_PREVIEWS
 
 //  
 #ifdef IMPLEMENT_SVG_THEME
@@ -35,16 +534,11 @@ bool ApplyChildrenTheme(Widget * widget, SvgThemes& themes, std::shared_ptr<Them
         modified = true;
     }
 
+    // Each child is visited once, as `widget` in the recursive call.
     for (Widget* child : widget->children) {
-        change = dynamic_cast<svg_theme::IApplyTheme*>(child);
-        if (change && change->applyTheme(themes, theme)) {
+        if (ApplyChildrenTheme(child, themes, theme, false)) {
             modified = true;
         }
-        if (!child->children.empty()) {
-            if (ApplyChildrenTheme(child, themes, theme, false)) {
-                modified = true;
-            }
-        }
     }
 
     if (top) {
@@ -57,13 +551,35 @@ bool ApplyChildrenTheme(Widget * widget, SvgThemes& themes, std::shared_ptr<Them
     return modified;
 }
 
-void AppendThemeMenu(Menu* menu, IThemeHolder* holder, SvgThemes& themes)
+void AppendThemeMenu(Menu* menu, IThemeHolder* holder, SvgThemes& themes, const std::string& previewFile)
 {
     auto theme_names = themes.getThemeNames();
     if (theme_names.empty()) return; // no themes
 
+#ifdef SVG_THEME_PREVIEWS
+    if (!previewFile.empty()) {
+        RequestThemePreviews(themes, previewFile, theme_names, THEME_MENU_PREVIEW_WIDTH, THEME_MENU_PREVIEW_HEIGHT);
+    }
+#else
+    (void)previewFile;
+#endif
+
     std::vector<rack::ui::MenuItem*> menus;
     for (auto theme : theme_names) {
+#ifdef SVG_THEME_PREVIEWS
+        if (!previewFile.empty()) {
+            auto item = new ThemePreviewMenuItem;
+            item->text = theme;
+            item->holder = holder;
+            item->theme = themes.getParsedTheme(theme);
+            item->previews = ThemeCacheManager::of(themes).previewCache();
+            item->file = previewFile;
+            item->preview_width = THEME_MENU_PREVIEW_WIDTH;
+            item->preview_height = THEME_MENU_PREVIEW_HEIGHT;
+            menus.push_back(item);
+            continue;
+        }
+#endif
         menus.push_back(createCheckMenuItem(
             theme, "", [=]() { return 0 == theme.compare(holder->getTheme()); },
             [=]() { holder->setTheme(theme); }
@@ -74,6 +590,802 @@ void AppendThemeMenu(Menu* menu, IThemeHolder* holder, SvgThemes& themes)
     }    
 }
 
+void ThemeBatch::add(const std::string& file, const std::shared_ptr<rack::window::Svg>& svg, SvgSetter set, Widget* owner)
+{
+    auto found = file_index.find(file);
+    if (found == file_index.end()) {
+        found = file_index.emplace(file, files.size()).first;
+        files.push_back(file);
+    }
+    targets.push_back(Target{found->second, &svg, set, owner});
+}
+
+void ThemeBatch::add(IApplyTheme* change, Widget* owner)
+{
+    widgets.push_back(std::make_pair(owner, change));
+}
+
+void ThemeBatch::clear()
+{
+    files.clear();
+    file_index.clear();
+    targets.clear();
+    widgets.clear();
+    file_ids.clear();
+    file_ids_cache = 0;
+}
+
+void ThemeBatch::collect(Widget* widget)
+{
+    auto provider = dynamic_cast<IThemeTargets*>(widget);
+    if (provider) {
+        provider->addThemeTargets(*this);
+    } else {
+        auto change = dynamic_cast<IApplyTheme*>(widget);
+        if (change) {
+            add(change, widget);
+        }
+    }
+    for (Widget* child : widget->children) {
+        collect(child);
+    }
+}
+
+static bool ApplyThemeToSvgId(SvgThemes& themes, ThemeCacheManager& manager, std::shared_ptr<Theme> theme, uint32_t file_id, std::shared_ptr<rack::window::Svg>& svg);
+
+bool ThemeBatch::apply(SvgThemes& themes, std::shared_ptr<Theme> theme)
+{
+    if (!theme) return false;
+    bool modified = false;
+    dirty.clear();
+
+    // Look the files up in the cache once, not on every apply
+    auto& manager = ThemeCacheManager::of(themes);
+    auto& cache = manager.svgCache();
+    if (file_ids_cache != cache.getSerial() || file_ids.size() != files.size()) {
+        file_ids.clear();
+        for (const std::string& file : files) {
+            file_ids.push_back(cache.fileId(file));
+        }
+        file_ids_cache = cache.getSerial();
+    }
+
+    // Theme each file once
+    themed.resize(files.size());
+    for (size_t n = 0; n < files.size(); ++n) {
+        ApplyThemeToSvgId(themes, manager, theme, file_ids[n], themed[n]);
+    }
+    for (const Target& target : targets) {
+        const std::shared_ptr<rack::window::Svg>& svg = themed[target.file];
+        if (svg && (*target.svg != svg)) {
+            target.set(svg);
+            modified = true;
+            if (target.owner) dirty.push_back(target.owner);
+        }
+    }
+    for (auto& widget : widgets) {
+        if (widget.second->applyTheme(themes, theme)) {
+            modified = true;
+            if (widget.first) dirty.push_back(widget.first);
+        }
+    }
+    // Let the cache evict what the targets no longer use
+    themed.clear();
+
+    std::sort(dirty.begin(), dirty.end());
+    dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+    for (Widget* widget : dirty) {
+        EventContext cDirty;
+        Widget::DirtyEvent eDirty;
+        eDirty.context = &cDirty;
+        widget->onDirty(eDirty);
+    }
+    return modified;
+}
+
+bool ApplyChildrenThemeBatch(Widget * widget, SvgThemes& themes, std::shared_ptr<Theme> theme)
+{
+    ThemeBatch batch;
+    batch.collect(widget);
+    return batch.apply(themes, theme);
+}
+
+void ThemeDispatcher::add(Widget* widget, IApplyTheme* change, IThemeTargets* targets)
+{
+    if (!change && !targets) return;
+    entries.push_back(Entry{widget, change, targets});
+    batch_ready = false;
+}
+
+void ThemeDispatcher::remove(Widget* widget)
+{
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+        [widget](const Entry& entry) { return entry.widget == widget; }),
+        entries.end());
+    batch_ready = false;
+}
+
+bool ThemeDispatcher::applyTheme(SvgThemes& themes, std::shared_ptr<Theme> theme)
+{
+    if (!batch_ready) {
+        batch.clear();
+        for (const Entry& entry : entries) {
+            if (entry.targets) {
+                entry.targets->addThemeTargets(batch);
+            } else {
+                batch.add(entry.change, entry.widget);
+            }
+        }
+        batch_ready = true;
+    }
+    return batch.apply(themes, theme);
+}
+
+ThemeWorkerPool& ThemeWorkerPool::instance()
+{
+    static ThemeWorkerPool pool;
+    return pool;
+}
+
+ThemeWorkerPool::ThemeWorkerPool(unsigned int max_threads) : max_threads(max_threads)
+{
+    if (0 == max_threads) {
+        unsigned int cores = std::thread::hardware_concurrency();
+        this->max_threads = std::min(4u, cores > 2 ? cores - 2 : 1u);
+    }
+}
+
+ThemeWorkerPool::~ThemeWorkerPool()
+{
+    shutdown();
+}
+
+void ThemeWorkerPool::submit(std::function<void()> job)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back(job);
+    if (workers.size() < max_threads && workers.size() < busy + jobs.size()) {
+        workers.emplace_back(&ThemeWorkerPool::run, this);
+    }
+    work.notify_one();
+}
+
+void ThemeWorkerPool::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]() { return jobs.empty() && 0 == busy; });
+}
+
+void ThemeWorkerPool::shutdown()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    stopping = true;
+    // A job may submit another, starting a thread while we join.
+    while (!workers.empty()) {
+        std::vector<std::thread> joining;
+        joining.swap(workers);
+        work.notify_all();
+        lock.unlock();
+        for (std::thread& worker : joining) {
+            worker.join();
+        }
+        lock.lock();
+    }
+    stopping = false;
+}
+
+void ThemeWorkerPool::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        work.wait(lock, [this]() { return stopping || !jobs.empty(); });
+        // Stopping: exit once the queue is drained.
+        if (jobs.empty()) break;
+        auto job = jobs.front();
+        jobs.pop_front();
+        ++busy;
+        lock.unlock();
+        job();
+        lock.lock();
+        --busy;
+        if (jobs.empty() && 0 == busy) {
+            idle.notify_all();
+        }
+    }
+}
+
+struct ThemeCacheManager::Counters {
+    std::atomic<uint64_t> file_applies{0}, file_apply_ns{0}, file_cache_hits{0}, file_cache_misses{0};
+    std::atomic<uint64_t> background_jobs{0}, background_ns{0};
+    std::atomic<uint64_t> previews_rendered{0}, preview_ns{0};
+};
+
+ThemeCacheManager& ThemeCacheManager::of(SvgThemes& themes)
+{
+    ThemeExtension* ext = themes.getExtension();
+    if (!ext) ext = themes.setExtension(std::unique_ptr<ThemeExtension>(new ThemeCacheManager()));
+    return *static_cast<ThemeCacheManager*>(ext);
+}
+
+ThemeCacheManager::ThemeCacheManager()
+{
+    SVG_THEME_COUNT(counters.reset(new Counters()));
+#ifdef SVG_THEME_PREVIEWS
+    previews = std::make_shared<ThemePreviewCache>();
+#endif
+}
+
+ThemeCacheManager::~ThemeCacheManager()
+{
+    wait();
+}
+
+void ThemeCacheManager::submit(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++pending;
+    }
+    ThemeWorkerPool::instance().submit([this, job]() {
+        {
+            SVG_THEME_COUNT(StatTimer timer(counters->background_jobs, counters->background_ns));
+            job();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        --pending;
+        done.notify_all();
+    });
+}
+
+void ThemeCacheManager::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return 0 == pending; });
+}
+
+void ThemeCacheManager::addStats(ThemeStats& stats) const
+{
+    if (!counters) return;
+#define SVG_THEME_STAT_GET(name) stats.name = counters->name.load(std::memory_order_relaxed);
+    SVG_THEME_RACK_STAT_FIELDS(SVG_THEME_STAT_GET)
+#undef SVG_THEME_STAT_GET
+}
+
+void ThemeCacheManager::resetStats()
+{
+    if (!counters) return;
+#define SVG_THEME_STAT_RESET(name) counters->name.store(0, std::memory_order_relaxed);
+    SVG_THEME_RACK_STAT_FIELDS(SVG_THEME_STAT_RESET)
+#undef SVG_THEME_STAT_RESET
+}
+
+// Run a job on the worker pool, counted for SvgThemes::waitPrewarm.
+static void SubmitThemeJob(SvgThemes& themes, std::function<void()> job)
+{
+    ThemeCacheManager::of(themes).submit(job);
+}
+
+// Theme a new copy of the file's master SVG, for the themed SVG cache.
+// The plan is not cached: the copy only ever has this theme, and the
+// cache drops it when the theme is reloaded (see Theme::version).
+// Safe on worker threads.
+static std::shared_ptr<rack::window::Svg> ThemedVariant(SvgThemes& themes, std::shared_ptr<Theme> theme, const std::string& svgFile)
+{
+    auto svg = SvgVariant::create(ThemeCacheManager::of(themes).svgCache().getMaster(svgFile));
+    if (!svg) return nullptr;
+    themes.applyPlan(*themes.bindTheme(theme, svg->handle), &svg->gradients);
+    return svg;
+}
+
+// ApplyThemeToSvg, for a file by its id in the themes' cache.
+static bool ApplyThemeToSvgId(SvgThemes& themes, ThemeCacheManager& manager, std::shared_ptr<Theme> theme, uint32_t file_id, std::shared_ptr<rack::window::Svg>& svg)
+{
+    SVG_THEME_COUNT(auto counters = manager.statCounters());
+    SVG_THEME_COUNT(StatTimer timer(counters->file_applies, counters->file_apply_ns));
+    // Check the themed cache for existing relevant svg
+    auto& cache = manager.svgCache();
+    std::shared_ptr<rack::window::Svg> newSvg = cache.find(file_id, *theme);
+    SVG_THEME_COUNT(Count(newSvg ? counters->file_cache_hits : counters->file_cache_misses));
+    if (!newSvg) {
+        auto variant = ThemedVariant(themes, theme, cache.fileName(file_id));
+        if (!variant) {
+            return false;
+        }
+        newSvg = cache.insert(file_id, *theme, variant);
+    }
+    if (newSvg != svg) {
+        svg = newSvg;
+        return true;
+    }
+    return false;
+}
+
+bool ApplyThemeToSvg(SvgThemes& themes, std::shared_ptr<Theme> theme, const std::string& svgFile, std::shared_ptr<rack::window::Svg>& svg)
+{
+    if (!theme) return false;
+    auto& manager = ThemeCacheManager::of(themes);
+    return ApplyThemeToSvgId(themes, manager, theme, manager.svgCache().fileId(svgFile), svg);
+}
+
+void PrewarmThemedSvgs(SvgThemes& themes, const std::vector<std::string>& files, const std::vector<std::string>& theme_names)
+{
+    auto& cache = ThemeCacheManager::of(themes).svgCache();
+    SvgThemes* owner = &themes;
+    for (auto name : theme_names) {
+        auto theme = themes.getParsedTheme(name);
+        if (!theme) continue;
+        for (auto file : files) {
+            if (!cache.claim(file, *theme)) continue;
+            SubmitThemeJob(themes, [owner, &cache, file, theme]() {
+                cache.insert(file, *theme, ThemedVariant(*owner, theme, file));
+            });
+        }
+    }
+}
+
+#ifdef SVG_THEME_PREVIEWS
+// Get the themed SVG from the themed SVG cache, theming a copy of the
+// master if it's not cached. Safe on worker threads.
+static std::shared_ptr<rack::window::Svg> BackgroundThemedSvg(SvgThemes& themes, std::shared_ptr<Theme> theme, const std::string& svgFile)
+{
+    auto& cache = ThemeCacheManager::of(themes).svgCache();
+    auto cached = cache.find(svgFile, *theme);
+    if (cached) return cached;
+    auto svg = ThemedVariant(themes, theme, svgFile);
+    if (!svg) return nullptr;
+    return cache.insert(svgFile, *theme, svg);
+}
+
+void RequestThemePreviews(SvgThemes& themes, const std::string& svgFile, const std::vector<std::string>& theme_names, int width, int height)
+{
+    auto& previews = *ThemeCacheManager::of(themes).previewCache();
+    SvgThemes* owner = &themes;
+    for (auto name : theme_names) {
+        auto theme = themes.getParsedTheme(name);
+        if (!theme || !previews.claim(svgFile, *theme, width, height)) continue;
+        unsigned int version = theme->version;
+        SubmitThemeJob(themes, [owner, &previews, svgFile, theme, version, width, height]() {
+            std::shared_ptr<ThemePreview> preview;
+            auto svg = BackgroundThemedSvg(*owner, theme, svgFile);
+            if (svg) {
+                SVG_THEME_COUNT(auto counters = ThemeCacheManager::of(*owner).statCounters());
+                SVG_THEME_COUNT(StatTimer timer(counters->previews_rendered, counters->preview_ns));
+                preview = std::make_shared<ThemePreview>();
+                if (!RenderThemePreview(svg->handle, width, height, *preview)) {
+                    preview = nullptr;
+                }
+            }
+            previews.insert(svgFile, *theme, width, height, version, preview);
+        });
+    }
+}
+
+bool RenderThemePreview(NSVGimage* svg, int max_width, int max_height, ThemePreview& preview)
+{
+    if (!svg || svg->width <= 0.f || svg->height <= 0.f || max_width <= 0 || max_height <= 0) return false;
+    float scale = std::min(max_width / svg->width, max_height / svg->height);
+    int width = std::max(1, std::min(max_width, static_cast<int>(std::ceil(svg->width * scale))));
+    int height = std::max(1, std::min(max_height, static_cast<int>(std::ceil(svg->height * scale))));
+
+    NSVGrasterizer* rasterizer = nsvgCreateRasterizer();
+    if (!rasterizer) return false;
+    preview.width = width;
+    preview.height = height;
+    preview.pixels.assign(static_cast<size_t>(width) * height * 4, 0);
+    nsvgRasterize(rasterizer, svg, 0.f, 0.f, scale, preview.pixels.data(), width, height, width * 4);
+    nsvgDeleteRasterizer(rasterizer);
+    return true;
+}
+
+void ThemePreviewCache::setBudget(size_t max_bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->max_bytes = max_bytes;
+    evict();
+}
+
+std::shared_ptr<const ThemePreview> ThemePreviewCache::find(const std::string& file, const Theme& theme, int max_width, int max_height)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = index.find(makeKey(file, theme, max_width, max_height));
+    if (found == index.end()) return nullptr;
+    if (found->second->version != theme.version) {
+        remove(found);
+        return nullptr;
+    }
+    lru.splice(lru.begin(), lru, found->second);
+    return found->second->preview;
+}
+
+bool ThemePreviewCache::claim(const std::string& file, const Theme& theme, int max_width, int max_height)
+{
+    Key key = makeKey(file, theme, max_width, max_height);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = index.find(key);
+    if (found != index.end()) {
+        if (found->second->version == theme.version) return false;
+        remove(found);
+    }
+    return pending.insert(key).second;
+}
+
+void ThemePreviewCache::insert(const std::string& file, const Theme& theme, int max_width, int max_height, unsigned int version, std::shared_ptr<const ThemePreview> preview)
+{
+    Key key = makeKey(file, theme, max_width, max_height);
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.erase(key);
+    if (!preview) return;
+    auto found = index.find(key);
+    if (found != index.end()) {
+        remove(found);
+    }
+    lru.push_front(Entry{key, preview, version});
+    index[key] = lru.begin();
+    total_bytes += preview->pixels.size();
+    evict();
+}
+
+void ThemePreviewCache::remove(std::map<Key, std::list<Entry>::iterator>::iterator found)
+{
+    total_bytes -= found->second->preview->pixels.size();
+    lru.erase(found->second);
+    index.erase(found);
+}
+
+void ThemePreviewCache::evict()
+{
+    if (!max_bytes) return;
+    auto it = lru.end();
+    while (it != lru.begin() && total_bytes > max_bytes) {
+        --it;
+        // Only previews held by nobody but the cache can be evicted.
+        if (it->preview.use_count() == 1) {
+            total_bytes -= it->preview->pixels.size();
+            index.erase(it->key);
+            it = lru.erase(it);
+        }
+    }
+}
+
+void ThemePreviewCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    lru.clear();
+    index.clear();
+    total_bytes = 0;
+}
+
+size_t ThemePreviewCache::size()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return lru.size();
+}
+
+size_t ThemePreviewCache::bytes()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return total_bytes;
+}
+
+ThemePreviewMenuItem::~ThemePreviewMenuItem()
+{
+    if (image) {
+        nvgDeleteImage(image_vg, image);
+    }
+}
+
+void ThemePreviewMenuItem::step()
+{
+    rightText = CHECKMARK(0 == text.compare(holder->getTheme()));
+    if (!preview && theme) {
+        // Only a lookup: the preview is rendered in the background.
+        preview = previews->find(file, *theme, preview_width, preview_height);
+    }
+    MenuItem::step();
+    // Room for the thumbnail between the name and the check mark
+    box.size.x += preview_width + 8.f;
+    box.size.y = std::max(float(BND_WIDGET_HEIGHT), preview_height + 4.f);
+}
+
+void ThemePreviewMenuItem::draw(const DrawArgs& args)
+{
+    MenuItem::draw(args);
+    if (!preview) return;
+    if (image && image_vg != args.vg) {
+        // Drawn into another context, such as a framebuffer's
+        nvgDeleteImage(image_vg, image);
+        image = 0;
+    }
+    if (!image) {
+        image = nvgCreateImageRGBA(args.vg, preview->width, preview->height, 0, preview->pixels.data());
+        if (!image) return;
+        image_vg = args.vg;
+    }
+    float x = box.size.x - bndLabelWidth(args.vg, -1, CHECKMARK_STRING) - 4.f - preview->width;
+    float y = (box.size.y - preview->height) / 2.f;
+    NVGpaint paint = nvgImagePattern(args.vg, x, y, preview->width, preview->height, 0.f, image, 1.f);
+    nvgBeginPath(args.vg);
+    nvgRect(args.vg, x, y, preview->width, preview->height);
+    nvgFillPaint(args.vg, paint);
+    nvgFill(args.vg);
+}
+
+void ThemePreviewMenuItem::onAction(const ActionEvent&)
+{
+    holder->setTheme(text);
+}
+
+#endif // SVG_THEME_PREVIEWS
+
+std::shared_ptr<SvgVariant> SvgVariant::create(std::shared_ptr<rack::window::Svg> master)
+{
+    if (!master || !master->handle) return nullptr;
+    auto variant = std::make_shared<SvgVariant>();
+    variant->handle = CloneImageVariant(master->handle);
+    if (!variant->handle) return nullptr;
+    variant->master = master;
+    return variant;
+}
+
+void ThemedSvgCache::setBudget(size_t max_entries, size_t max_bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->max_entries = max_entries;
+    this->max_bytes = max_bytes;
+    evict();
+}
+
+// Serial numbers start at 1, so that 0 is none.
+static uint64_t NextSerial()
+{
+    static std::atomic<uint64_t> last{0};
+    return ++last;
+}
+
+ThemedSvgCache::ThemedSvgCache() : serial(NextSerial())
+{
+}
+
+uint32_t ThemedSvgCache::internFile(const std::string& file)
+{
+    auto file_id = file_ids.find(file);
+    if (file_id == file_ids.end()) {
+        file_id = file_ids.emplace(file, static_cast<uint32_t>(files.size())).first;
+        files.push_back(file);
+    }
+    return file_id->second;
+}
+
+bool ThemedSvgCache::findKey(uint32_t file_id, const Theme& theme, uint64_t& key)
+{
+    auto theme_file = theme_ids.find(theme.file);
+    if (theme_file == theme_ids.end()) return false;
+    auto theme_id = theme_file->second.find(theme.name);
+    if (theme_id == theme_file->second.end()) return false;
+    key = (static_cast<uint64_t>(file_id) << 32) | theme_id->second;
+    return true;
+}
+
+uint64_t ThemedSvgCache::internKey(uint32_t file_id, const Theme& theme)
+{
+    auto& names = theme_ids[theme.file];
+    auto theme_id = names.find(theme.name);
+    if (theme_id == names.end()) {
+        theme_id = names.emplace(theme.name, static_cast<uint32_t>(theme_names.size())).first;
+        theme_names.push_back(ThemeName{theme.file, theme.name});
+    }
+    return (static_cast<uint64_t>(file_id) << 32) | theme_id->second;
+}
+
+uint32_t ThemedSvgCache::fileId(const std::string& file)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return internFile(file);
+}
+
+const std::string& ThemedSvgCache::fileName(uint32_t file_id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return files[file_id];
+}
+
+std::shared_ptr<rack::window::Svg> ThemedSvgCache::find(const std::string& file, const Theme& theme)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto file_id = file_ids.find(file);
+    if (file_id == file_ids.end()) {
+        ++stats.misses;
+        return nullptr;
+    }
+    return findLocked(file_id->second, theme);
+}
+
+std::shared_ptr<rack::window::Svg> ThemedSvgCache::find(uint32_t file_id, const Theme& theme)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return findLocked(file_id, theme);
+}
+
+std::shared_ptr<rack::window::Svg> ThemedSvgCache::findLocked(uint32_t file_id, const Theme& theme)
+{
+    uint64_t key;
+    if (findKey(file_id, theme, key)) {
+        auto found = index.find(key);
+        if (found != index.end()) {
+            if (found->second->version == theme.version) {
+                ++stats.hits;
+                lru.splice(lru.begin(), lru, found->second);
+                return found->second->svg;
+            }
+            removeStale(found);
+        }
+    }
+    ++stats.misses;
+    return nullptr;
+}
+
+std::shared_ptr<rack::window::Svg> ThemedSvgCache::insert(const std::string& file, const Theme& theme, std::shared_ptr<rack::window::Svg> svg)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return insertLocked(internFile(file), theme, svg);
+}
+
+std::shared_ptr<rack::window::Svg> ThemedSvgCache::insert(uint32_t file_id, const Theme& theme, std::shared_ptr<rack::window::Svg> svg)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return insertLocked(file_id, theme, svg);
+}
+
+std::shared_ptr<rack::window::Svg> ThemedSvgCache::insertLocked(uint32_t file_id, const Theme& theme, std::shared_ptr<rack::window::Svg> svg)
+{
+    uint64_t key = internKey(file_id, theme);
+    pending.erase(key);
+    if (!svg) return svg;
+    auto found = index.find(key);
+    if (found != index.end()) {
+        if (found->second->version == theme.version) {
+            return found->second->svg;
+        }
+        removeStale(found);
+    }
+    auto master = masters.find(files[file_id]);
+    size_t bytes = ImageBytes(svg->handle, master != masters.end() ? master->second->handle : nullptr);
+    lru.push_front(Entry{key, svg, bytes, theme.version});
+    index[key] = lru.begin();
+    ++stats.entries;
+    stats.bytes += bytes;
+    evict();
+    return svg;
+}
+
+bool ThemedSvgCache::claim(const std::string& file, const Theme& theme)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t key = internKey(internFile(file), theme);
+    auto found = index.find(key);
+    if (found != index.end() && found->second->version == theme.version) return false;
+    return pending.insert(key).second;
+}
+
+void ThemedSvgCache::removeStale(std::unordered_map<uint64_t, std::list<Entry>::iterator>::iterator found)
+{
+    // Widgets may still hold the SVG, but it leaves the cache, and is deleted
+    // once they replace it.
+    --stats.entries;
+    stats.bytes -= found->second->bytes;
+    lru.erase(found->second);
+    index.erase(found);
+}
+
+bool ThemedSvgCache::overBudget()
+{
+    return (max_entries && stats.entries > max_entries)
+        || (max_bytes && stats.bytes > max_bytes);
+}
+
+void ThemedSvgCache::evict()
+{
+    if (!overBudget()) return;
+    auto it = lru.end();
+    while (it != lru.begin() && overBudget()) {
+        --it;
+        // Only entries held by nobody but the cache can be evicted.
+        if (it->svg.use_count() == 1) {
+            index.erase(it->key);
+            ++stats.evictions;
+            --stats.entries;
+            stats.bytes -= it->bytes;
+            it = lru.erase(it);
+        }
+    }
+}
+
+std::shared_ptr<rack::window::Svg> ThemedSvgCache::getMaster(const std::string& file)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = masters.find(file);
+        if (found != masters.end()) return found->second;
+    }
+
+    // Load outside the lock. If another thread loads the same file
+    // meanwhile, the first one in wins.
+    std::shared_ptr<rack::window::Svg> master;
+    try {
+        master = std::make_shared<rack::window::Svg>();
+        master->loadFile(file);
+    }
+    catch (rack::Exception& e) {
+        WARN("%s", e.what());
+        return nullptr;
+    }
+    if (!master->handle) return nullptr;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    return masters.emplace(file, master).first->second;
+}
+
+void ThemedSvgCache::trim()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    evict();
+}
+
+void ThemedSvgCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    lru.clear();
+    index.clear();
+    masters.clear();
+    stats.entries = 0;
+    stats.bytes = 0;
+}
+
+size_t ThemedSvgCache::size()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return lru.size();
+}
+
+SvgCacheStats ThemedSvgCache::getStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void ThemedSvgCache::resetStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.hits = 0;
+    stats.misses = 0;
+    stats.evictions = 0;
+}
+
+void ThemedSvgCache::forEach(std::function<void(const std::string& file, const std::string& theme_file, const std::string& theme_name, rack::window::Svg* svg)> visit)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const Entry& entry : lru) {
+        const ThemeName& theme = theme_names[static_cast<uint32_t>(entry.key)];
+        visit(files[entry.key >> 32], theme.file, theme.name, entry.svg.get());
+    }
+}
+
+struct SvgByTheme : rack::window::Svg {
+
+	static size_t cacheSize(SvgThemes& themes) { return ThemeCacheManager::of(themes).svgCache().size(); }
+
+	static void showCache(SvgThemes& themes) {
+		auto& cache = ThemeCacheManager::of(themes).svgCache();
+		unsigned int n = 0;
+		cache.forEach([&n](const std::string& file, const std::string& theme_file, const std::string& theme_name, rack::window::Svg* svg) {
+			DEBUG("%u %s %s %s %p", ++n, file.c_str(), theme_file.c_str(), theme_name.c_str(), svg);
+		});
+		auto stats = cache.getStats();
+		DEBUG("%zu entries, %zu bytes, %zu hits, %zu misses, %zu evictions",
+			stats.entries, stats.bytes, stats.hits, stats.misses, stats.evictions);
+	}
+};
+
 #endif // #ifdef IMPLEMENT_SVG_THEME
 
 } // namespace svg_theme
@@ -0,0 +1,33 @@
+// svt_compile - compiles an svg_theme JSON theme file to the binary format
+// read by SvgThemes::loadCompiled.
+//
+// usage: svt_compile <themes.json> <themes.svtc>
+//
+// Build with `make svt_compile` from the repository root.
+
+#define IMPLEMENT_SVG_THEME
+#define NANOSVG_IMPLEMENTATION
+#include "../svgtheme.hpp"
+
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        std::fprintf(stderr, "usage: svt_compile <themes.json> <themes.svtc>\n");
+        return 2;
+    }
+
+    svg_theme::SvgThemes themes;
+    themes.setLog([](svg_theme::Severity severity, svg_theme::ErrorCode code, std::string info) {
+        std::fprintf(stderr, "%s (%d): %s\n", svg_theme::SeverityName(severity), code, info.c_str());
+    }, svg_theme::Severity::Warn);
+
+    if (!themes.load(argv[1])) {
+        return 1;
+    }
+    if (!themes.saveCompiled(argv[2])) {
+        return 1;
+    }
+    auto names = themes.getThemeNames();
+    std::printf("%s: %zu themes\n", argv[2], names.size());
+    return 0;
+}